@@ -78,6 +78,7 @@
  * Sinds normally @htmlonly&dash;@endhtmlonly for some instance of AIEngine @htmlonly&dash;\endhtmlonly
  * it is the <em>same</em> thread that calls the AIEngine::mainloop member function in the main loop of that thread,
  * there is a one-on-one relationship between a thread and an AIEngine object.
+ * If you need several threads to run the tasks of a single engine, use AISharedEngine instead.
  *
  * Once a task is added to an engine then every time the thread of that engine returns to its main loop,
  * it processes one or more tasks in its queue until either &mdash; all tasks are finished, idle, moved to another handler
@@ -146,6 +147,8 @@ class AIEngine
 
  private:
   engine_state_type mEngineState;
+
+ protected:
   char const* mName;
   duration_type mMaxDuration;
   bool mHasMaxDuration;
@@ -164,6 +167,9 @@ class AIEngine
    */
   AIEngine(char const* name, float max_duration = 0.0f) : mName(name) { setMaxDuration(max_duration); }
 
+  /// Destructor.
+  virtual ~AIEngine() = default;
+
   /**
    * Add @a stateful_task to this engine.
    *
@@ -174,7 +180,7 @@ class AIEngine
    *
    * @param stateful_task The task to add.
    */
-  void add(AIStatefulTask* stateful_task);
+  virtual void add(AIStatefulTask* stateful_task);
 
   /**
    * The main loop of the engine.
@@ -188,10 +194,10 @@ class AIEngine
    * when one or more tasks called yield or when the call exceeded max_duration
    * and there is still one or more task left that wasn't executed.
    */
-  utils::FuzzyBool mainloop();
+  virtual utils::FuzzyBool mainloop();
 
   /// Wake up a sleeping engine.
-  void wake_up();
+  virtual void wake_up();
 
   /**
    * Flush all tasks from this engine.
@@ -201,7 +207,7 @@ class AIEngine
    * all remaining objects, to avoid that tasks do call backs and use objects
    * that are being destructed.
    */
-  void flush();
+  virtual void flush();
 
   /**
    * Return a human readable name of this engine.
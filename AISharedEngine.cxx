@@ -0,0 +1,163 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Implementation of AISharedEngine.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "AISharedEngine.h"
+
+void AISharedEngine::add(AIStatefulTask* stateful_task)
+{
+  Dout(dc::statefultask(stateful_task->mSMDebug), "Adding stateful task [" << (void*)stateful_task << "] to shared engine " << mName);
+  shared_engine_state_type::wat engine_state_w(mSharedEngineState);
+  auto result = engine_state_w->tasks.try_emplace(stateful_task, queued);
+  if (!result.second)
+  {
+    // The task is already queued, or claimed by a thread that is running it.
+    // In the latter case that thread will put it back in the queue when it is done.
+    if (result.first->second == running)
+      result.first->second = running_readded;
+    return;
+  }
+  engine_state_w->queue.emplace_back(stateful_task);
+  if (engine_state_w->waiting > 0)
+    engine_state_w.notify_one();
+}
+
+// Run tasks from the front of the queue until the number of tasks that were queued upon entry
+// were run, or until the time in mMaxDuration was exceeded.
+//
+// Each task is claimed by the calling thread for the duration of its run (it is removed from
+// the queue, but not from `tasks`), so that other threads calling mainloop() at the same time
+// never run the same task concurrently.
+utils::FuzzyBool AISharedEngine::mainloop()
+{
+  std::size_t tasks_to_run;
+  {
+    shared_engine_state_type::wat engine_state_w(mSharedEngineState);
+    // Is there anything to do?
+    if (engine_state_w->queue.empty())
+    {
+      if (!mHasMaxDuration)
+      {
+        // Sleep here until a new task is added, or until wake_up() is called.
+        unsigned int const generation = engine_state_w->generation;
+        ++engine_state_w->waiting;
+        engine_state_w.wait([&](){ return !engine_state_w->queue.empty() || engine_state_w->generation != generation; });
+        --engine_state_w->waiting;
+        return fuzzy::True;
+      }
+      return fuzzy::WasFalse;
+    }
+    tasks_to_run = engine_state_w->queue.size();
+  }
+  duration_type total_duration(duration_type::zero());
+  bool one_or_more_tasks_called_yield = false;
+  bool queue_empty = false;
+  do
+  {
+    boost::intrusive_ptr<AIStatefulTask> stateful_task;
+    bool only_task;
+    {
+      shared_engine_state_type::wat engine_state_w(mSharedEngineState);
+      // Other threads might have emptied the queue in the meantime.
+      if (engine_state_w->queue.empty())
+      {
+        queue_empty = true;
+        break;
+      }
+      // Claim the task at the front of the queue.
+      stateful_task = std::move(engine_state_w->queue.front());
+      engine_state_w->queue.pop_front();
+      engine_state_w->tasks[stateful_task.get()] = running;
+      only_task = engine_state_w->queue.empty();        // This is fuzzy, but so is the same test in AIEngine::mainloop.
+    }
+
+    if (mHasMaxDuration)
+    {
+      clock_type::time_point start = clock_type::now();
+      if (!stateful_task->sleep(start, only_task))
+        stateful_task->insert_multiplex(AIStatefulTask::normal_run, this);
+      clock_type::duration delta = clock_type::now() - start;
+      stateful_task->add(delta);
+      total_duration += delta;
+    }
+    else
+      stateful_task->insert_multiplex(AIStatefulTask::normal_run, this);
+
+    // Still running in this engine? This must be called before locking mSharedEngineState (see AIEngine::mainloop).
+    bool active = stateful_task->active(this);
+    shared_engine_state_type::wat engine_state_w(mSharedEngineState);
+    auto task_iter = engine_state_w->tasks.find(stateful_task.get());
+    // Only the claiming thread removes a task from `tasks`.
+    ASSERT(task_iter != engine_state_w->tasks.end() && task_iter->second != queued);
+    if (active || task_iter->second == running_readded)
+    {
+      // Give up our claim by putting the task back at the end of the queue.
+      task_iter->second = queued;
+      engine_state_w->queue.push_back(std::move(stateful_task));
+      if (engine_state_w->waiting > 0)
+        engine_state_w.notify_one();
+      // The only reason to return from multiplex while still active is when yield() was called.
+      one_or_more_tasks_called_yield |= active;
+    }
+    else
+    {
+      Dout(dc::statefultask(stateful_task->mSMDebug), "Erasing stateful task [" << (void*)stateful_task.get() << "] from shared engine \"" << mName << "\".");
+      engine_state_w->tasks.erase(task_iter);
+    }
+    queue_empty = engine_state_w->queue.empty();
+    if (mHasMaxDuration && total_duration >= mMaxDuration)
+      break;
+  }
+  while (--tasks_to_run > 0);
+  // Return true if there are remaining tasks.
+  return (one_or_more_tasks_called_yield || !queue_empty) ? fuzzy::True : fuzzy::WasFalse;
+}
+
+void AISharedEngine::flush()
+{
+  shared_engine_state_type::wat engine_state_w(mSharedEngineState);
+  DoutEntering(dc::statefultask, "AISharedEngine::flush [" << mName << "]: calling force_killed() on " << engine_state_w->queue.size() << " stateful tasks.");
+  // Only call flush() when no thread is running mainloop() anymore.
+  ASSERT(engine_state_w->queue.size() == engine_state_w->tasks.size());
+  for (auto& stateful_task : engine_state_w->queue)
+  {
+    // To avoid an assertion in ~AIStatefulTask.
+    stateful_task->force_killed();
+  }
+  engine_state_w->queue.clear();
+  engine_state_w->tasks.clear();
+}
+
+void AISharedEngine::wake_up()
+{
+  shared_engine_state_type::wat engine_state_w(mSharedEngineState);
+  if (engine_state_w->waiting > 0)
+  {
+    ++engine_state_w->generation;
+    engine_state_w.notify_all();
+  }
+}
@@ -0,0 +1,119 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Declaration of class AISharedEngine.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "AIEngine.h"
+#include <deque>
+#include <unordered_map>
+
+/**
+ * Task queue and dispatcher that can be served by several threads at once.
+ *
+ * Where an AIEngine has a one-on-one relationship with the thread that calls
+ * its @ref AIEngine::mainloop, an AISharedEngine may be run by any number of
+ * threads concurrently: each thread simply calls @ref mainloop in its main loop.
+ *
+ * A task that is added to a shared engine is owned by at most one of those
+ * threads at a time: a thread claims a task by taking it from the front of the
+ * queue and only gives up that claim after returning from @c multiplex, either
+ * by putting the task back at the end of the queue (when it still needs CPU) or
+ * by forgetting about it. A call to @ref add while a task is claimed is remembered
+ * and causes the claiming thread to requeue the task; so a task is never in the
+ * queue twice and never run by two threads at the same time.
+ *
+ * Because an AISharedEngine is an AIEngine, it can be used everywhere that an engine
+ * can be used, including as argument of @link AIStatefulTask::yield_frame yield_frame@endlink
+ * and @link AIStatefulTask::yield_ms yield_ms@endlink (provided a max_duration was set).
+ * In that case a frame is one entry into @ref mainloop by any of the threads.
+ *
+ * Unlike AIEngine, tasks are run in FIFO order; the queue is not sorted by previous execution time.
+ */
+class AISharedEngine : public AIEngine
+{
+ private:
+  // The states that a task added to this engine can be in.
+  enum claim_type {
+    queued,             // The task is in the queue and not claimed by any thread.
+    running,            // The task was taken from the queue and is being run by some thread.
+    running_readded     // Idem, but add() was called while it was running.
+  };
+
+  struct shared_engine_state_st
+  {
+    std::deque<boost::intrusive_ptr<AIStatefulTask>> queue;     // Tasks that need to run and are not claimed.
+    std::unordered_map<AIStatefulTask const*, claim_type> tasks;  // All tasks that are queued or claimed.
+    unsigned int generation;                                    // Incremented by wake_up().
+    int waiting;                                                // The number of threads that are sleeping in mainloop().
+    shared_engine_state_st() : generation(0), waiting(0) { }
+  };
+
+  using shared_engine_state_type = aithreadsafe::Wrapper<shared_engine_state_st, aithreadsafe::policy::Primitive<aithreadsafe::ConditionVariable>>;
+
+  shared_engine_state_type mSharedEngineState;
+
+ public:
+  /**
+   * Construct an AISharedEngine.
+   *
+   * The arguments are the same as those of AIEngine::AIEngine.
+   *
+   * @param name A human readable name for this engine. Mainly used for debug output.
+   * @param max_duration The maximum duration per call to @ref mainloop (in milliseconds). See AIEngine::setMaxDuration.
+   */
+  AISharedEngine(char const* name, float max_duration = 0.0f) : AIEngine(name, max_duration) { }
+
+  /**
+   * Add @a stateful_task to this engine.
+   *
+   * Normally you should not call this function directly. Instead, use @link group_run AIStatefulTask::run@endlink.
+   *
+   * @param stateful_task The task to add.
+   */
+  void add(AIStatefulTask* stateful_task) override;
+
+  /**
+   * The main loop of the engine; may be called by any number of threads concurrently.
+   *
+   * Run tasks from the queue until as many tasks were run as there were
+   * queued upon entry, or until mMaxDuration milliseconds have passed if
+   * a maximum duration was set.
+   *
+   * Returns true if there are still tasks in the engine that require CPU.
+   */
+  utils::FuzzyBool mainloop() override;
+
+  /// Wake up all threads that are sleeping in @ref mainloop.
+  void wake_up() override;
+
+  /**
+   * Flush all queued tasks from this engine.
+   *
+   * This may only be called when no thread is running @ref mainloop anymore.
+   */
+  void flush() override;
+};
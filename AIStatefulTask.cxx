@@ -41,6 +41,9 @@
 #include "sys.h"
 #include "AIEngine.h"
 #include "threadpool/AIThreadPool.h"
+#include <cstddef>
+#include <initializer_list>
+#include <ostream>
 #ifdef TRACY_FIBERS
 #include <Tracy.hpp>
 #include "utils/at_scope_end.h"
@@ -473,6 +476,7 @@ char const* AIStatefulTask::event_str(event_type event)
   {
     AI_CASE_RETURN(initial_run);
     AI_CASE_RETURN(schedule_run);
+    AI_CASE_RETURN(handoff_run);
     AI_CASE_RETURN(normal_run);
     AI_CASE_RETURN(insert_abort);
   }
@@ -559,7 +563,7 @@ void AIStatefulTask::multiplex(event_type event, Handler handler)
     // equal to that engine; and we return if the above test fails anyway). Hence,
     // we get here only for tasks with a non-null current_engine, but for any base state.
     ASSERT(event != initial_run || state_r->base_state == bs_reset);
-    ASSERT((event != schedule_run && event != insert_abort) || state_r->base_state == bs_multiplex);
+    ASSERT((event != schedule_run && event != handoff_run && event != insert_abort) || state_r->base_state == bs_multiplex);
 
     // If another thread is already running multiplex() then it will pick up
     // our need to run (by us having set need_run), so there is no need to run
@@ -592,7 +596,7 @@ void AIStatefulTask::multiplex(event_type event, Handler handler)
     // the same state twice. Note that if need_run was reset in the mean
     // time and then set again, then it can't hurt to schedule a run since
     // we should indeed run, again.
-    if (event == schedule_run && !sub_state_type::rat(mSubState)->need_run)
+    if ((event == schedule_run || event == handoff_run) && !sub_state_type::rat(mSubState)->need_run)
     {
       mMultiplexMutex.unlock();
       Dout(dc::statefultask(mSMDebug), "Leaving because it was already being run [" << (void*)this << "]");
@@ -944,7 +948,12 @@ void AIStatefulTask::multiplex(event_type event, Handler handler)
           {
             // Mark that we want to run in this engine (thread pool), and at the same time, that we don't want to run in the previous one.
             state_w->current_handler = handler;
-            if (handler.is_engine())
+            if (event == handoff_run && handler == tl_running_handler)
+            {
+              // Let this thread run the task directly after the task that it is currently running returns from multiplex().
+              push_run(tl_handoff_head, tl_handoff_tail, this);
+            }
+            else if (handler.is_engine())
             {
               // Actually add the task to the engine.
               handler.m_handle.engine->add(this);
@@ -1008,15 +1017,270 @@ void AIStatefulTask::multiplex(event_type event, Handler handler)
 
 //static
 thread_local AIStatefulTask* AIStatefulTask::tl_parent_task;
+//static
+thread_local AIStatefulTask const* AIStatefulTask::tl_timer_expiring_task;
+
+//static
+thread_local int AIStatefulTask::tl_multiplex_depth;
+//static
+thread_local AIStatefulTask* AIStatefulTask::tl_deferred_head;
+//static
+thread_local AIStatefulTask* AIStatefulTask::tl_deferred_tail;
+//static
+thread_local AIStatefulTask* AIStatefulTask::tl_handoff_head;
+//static
+thread_local AIStatefulTask* AIStatefulTask::tl_handoff_tail;
+//static
+thread_local AIStatefulTask::Handler AIStatefulTask::tl_running_handler{Handler::idle};
+
+//static
+void AIStatefulTask::push_run(AIStatefulTask*& head, AIStatefulTask*& tail, AIStatefulTask* task)
+{
+  // A task is in at most one list at a time.
+  ASSERT(!task->mNextRun);
+  intrusive_ptr_add_ref(task);
+  task->mNextRun = task;        // The last task in the list points to itself.
+  if (head)
+    tail->mNextRun = task;
+  else
+    head = task;
+  tail = task;
+}
+
+//static
+AIStatefulTask* AIStatefulTask::pop_run(AIStatefulTask*& head, AIStatefulTask*& tail)
+{
+  AIStatefulTask* task = head;
+  if (task)
+  {
+    head = task->mNextRun == task ? nullptr : task->mNextRun;
+    if (!head)
+      tail = nullptr;
+    task->mNextRun = nullptr;
+  }
+  return task;
+}
+
+void AIStatefulTask::defer_multiplex(event_type event)
+{
+  DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::defer_multiplex(" << event_str(event) << ") [" << (void*)this << "]");
+  // A task only gets a new schedule_run or handoff_run when it goes from idle to not idle, so it can only
+  // already be deferred if it was aborted and then restarted by run(); in that case the initial_run wins.
+  if (AI_UNLIKELY(mNextRun))
+  {
+    if (event == initial_run)
+      mDeferredEvent = initial_run;
+    return;
+  }
+  mDeferredEvent = event;
+  push_run(tl_deferred_head, tl_deferred_tail, this);
+}
+
+void AIStatefulTask::run_deferred_multiplex()
+{
+  // Called from insert_multiplex after the outermost multiplex() returned.
+  ASSERT(tl_multiplex_depth == 0);
+  // Call multiplex() directly, instead of through insert_multiplex, so that this loop is never entered recursively.
+  // Runs that are deferred while executing these runs are appended to the list and handled by this same loop.
+  while (AIStatefulTask* task = pop_run(tl_deferred_head, tl_deferred_tail))
+  {
+    boost::intrusive_ptr<AIStatefulTask> deferred_task(task, false);    // Adopt the reference of the list.
+    event_type const event = task->mDeferredEvent;
+    // Unlike a direct call from signal(), a deferred schedule_run or handoff_run can find
+    // that the task was aborted or finished in the meantime; multiplex() asserts on that.
+    if ((event == schedule_run || event == handoff_run) &&
+        multiplex_state_type::crat(task->mState)->base_state != bs_multiplex)
+    {
+      Dout(dc::statefultask(task->mSMDebug), "Skipping deferred " << event_str(event) << " because the task finished in the meantime [" << (void*)task << "]");
+      continue;
+    }
+    ++tl_multiplex_depth;
+    task->multiplex(event);
+    --tl_multiplex_depth;
+  }
+}
+
+void AIStatefulTask::run_handed_off(Handler handler)
+{
+  // Tasks that are handed off while running these are appended to the list and handled by this same loop.
+  while (AIStatefulTask* task = pop_run(tl_handoff_head, tl_handoff_tail))
+  {
+    boost::intrusive_ptr<AIStatefulTask> handed_off_task(task, false);  // Adopt the reference of the list.
+    task->multiplex(normal_run, handler);
+    // A task that was handed off isn't in the queue of its engine or thread pool.
+    // Add it there if it needs to run again.
+    if (task->active(handler))
+    {
+      if (handler.is_engine())
+        handler.m_handle.engine->add(task);
+      else
+        task->add_task_to_thread_pool(handler.get_queue_handle());
+    }
+  }
+}
 
 #ifdef TRACY_FIBERS
 //static
 thread_local char const* AIStatefulTask::s_tl_tracy_fiber_name;
 #endif
 
+//==================================================================
+// Object layout
+//
+// Many tasks can be alive at the same time, so the size of AIStatefulTask matters;
+// and the members that are accessed every time a task runs (including the mutexes
+// that are locked on every run) should be contiguous, starting in the first cache line.
+// They span several cache lines because of those mutexes; print_layout_on reports the details.
+//
+// The following checks the layout of AIStatefulTask at compile time.
+// If you add a member to AIStatefulTask then you also have to add it to the list below
+// (in order of declaration), or compilation will fail. Members that are not needed on
+// every run belong in cold_state_st instead.
+
+namespace {
+
+struct member_st
+{
+  std::size_t size;
+  std::size_t alignment;
+};
+
+template<typename T>
+constexpr member_st member() { return { sizeof(T), alignof(T) }; }
+
+// Return the offset directly behind the last of `members` when the first one is placed at `offset`.
+constexpr std::size_t end_of(std::size_t offset, std::initializer_list<member_st> members)
+{
+  for (member_st const& m : members)
+    offset = (offset + m.alignment - 1) / m.alignment * m.alignment + m.size;
+  return offset;
+}
+
+} // namespace
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+
+struct AIStatefulTask::Layout
+{
+  static constexpr std::size_t cache_line_size = 64;
+
+  // The hot members: from mSleep up till and including mSubState.
+  static constexpr std::size_t hot_begin = offsetof(AIStatefulTask, mSleep);
+  static constexpr std::size_t hot_end = offsetof(AIStatefulTask, mSubState) + sizeof(mSubState);
+  // The (minimal) number of cache lines that a run of the task touches for its hot members.
+  static constexpr std::size_t hot_cache_lines = (hot_end - hot_begin + cache_line_size - 1) / cache_line_size;
+  // The target: the three mutexes (40 bytes each for std::mutex) make one cache line impossible,
+  // but everything that is needed for a run fits in four of them.
+  static constexpr std::size_t max_hot_size = 4 * cache_line_size;
+
+  // Where mMultiplexMutex would be without the members for thread confinement.
+  static constexpr std::size_t multiplex_mutex_without_confinement = end_of(hot_begin, {
+      member<decltype(mSleep)>(),
+      member<decltype(mDefaultHandler)>(),
+      member<decltype(mTargetHandler)>(),
+      member<decltype(mYield)>(),
+      member<decltype(mTimerArmed)>(),
+      member<decltype(mMultiplexMutex)>(),
+  }) - sizeof(mMultiplexMutex);
+
+  // All members of AIStatefulTask, in order of declaration.
+  static constexpr std::size_t members_end = end_of(hot_begin, {
+      member<decltype(mSleep)>(),
+      member<decltype(mDefaultHandler)>(),
+      member<decltype(mTargetHandler)>(),
+      member<decltype(mYield)>(),
+      member<decltype(mTimerArmed)>(),
+      member<decltype(mThreadConfined)>(),
+      member<decltype(mConfinedRefCount)>(),
+      member<decltype(mMultiplexMutex)>(),
+      member<decltype(mState)>(),
+      member<decltype(mSubState)>(),
+      member<decltype(mRunMutex)>(),
+      member<decltype(mCold)>(),
+      member<decltype(mDuration)>(),
+      member<decltype(mHeldMutexes)>(),
+      member<decltype(mThreadPoolEntry)>(),
+      member<decltype(mNextRun)>(),
+      member<decltype(mDeferredEvent)>(),
+#if CW_DEBUG
+      member<decltype(mThreadId)>(),
+      member<decltype(mDebugLastState)>(),
+      member<decltype(mDebugShouldRun)>(),
+      member<decltype(mDebugAborted)>(),
+      member<decltype(mDebugSignalPending)>(),
+      member<decltype(mDebugSetStatePending)>(),
+      member<decltype(mDebugRefCalled)>(),
+      member<decltype(mConfinedThreadId)>(),
+#endif
+#ifdef CWDEBUG
+      member<decltype(mSMDebug)>(),
+#endif
+#if CW_DEBUG
+      member<decltype(m_may_not_be_deleted)>(),
+#endif
+#ifdef TRACY_FIBERS
+      member<decltype(m_tracy_fiber_name)>(),
+#endif
+  });
+  static constexpr std::size_t size = (members_end + alignof(AIStatefulTask) - 1) / alignof(AIStatefulTask) * alignof(AIStatefulTask);
+
+  static_assert(sizeof(AIStatefulTask) == size, "AIStatefulTask has members that are not listed in AIStatefulTask::Layout.");
+  static_assert(hot_begin < cache_line_size, "The hot members of AIStatefulTask no longer start in the first cache line.");
+  static_assert(hot_end - hot_begin <= max_hot_size, "The hot members of AIStatefulTask no longer fit in four cache lines.");
+  static_assert(offsetof(AIStatefulTask, mMultiplexMutex) == multiplex_mutex_without_confinement,
+      "The members for thread confinement no longer fit in the padding in front of mMultiplexMutex.");
+};
+
+//static
+void AIStatefulTask::print_layout_on(std::ostream& os)
+{
+  os << "sizeof(AIStatefulTask) = " << sizeof(AIStatefulTask) << "; hot members: [" << Layout::hot_begin << ", " << Layout::hot_end <<
+    ") (" << Layout::hot_cache_lines << " cache lines)\n";
+#define AI_PRINT_MEMBER(m) os << "  " #m ": offset " << offsetof(AIStatefulTask, m) << ", size " << sizeof(m) << '\n'
+  AI_PRINT_MEMBER(mSleep);
+  AI_PRINT_MEMBER(mDefaultHandler);
+  AI_PRINT_MEMBER(mTargetHandler);
+  AI_PRINT_MEMBER(mYield);
+  AI_PRINT_MEMBER(mTimerArmed);
+  AI_PRINT_MEMBER(mThreadConfined);
+  AI_PRINT_MEMBER(mConfinedRefCount);
+  AI_PRINT_MEMBER(mMultiplexMutex);
+  AI_PRINT_MEMBER(mState);
+  AI_PRINT_MEMBER(mSubState);
+  AI_PRINT_MEMBER(mRunMutex);
+  AI_PRINT_MEMBER(mCold);
+  AI_PRINT_MEMBER(mDuration);
+  AI_PRINT_MEMBER(mHeldMutexes);
+  AI_PRINT_MEMBER(mThreadPoolEntry);
+  AI_PRINT_MEMBER(mNextRun);
+  AI_PRINT_MEMBER(mDeferredEvent);
+#if CW_DEBUG
+  AI_PRINT_MEMBER(mThreadId);
+  AI_PRINT_MEMBER(mConfinedThreadId);
+#endif
+#ifdef TRACY_FIBERS
+  AI_PRINT_MEMBER(m_tracy_fiber_name);
+#endif
+#undef AI_PRINT_MEMBER
+}
+
+//static
+AIStatefulTask::layout_st AIStatefulTask::layout()
+{
+  return { sizeof(AIStatefulTask), Layout::hot_begin, Layout::hot_end, Layout::max_hot_size };
+}
+
+#pragma GCC diagnostic pop
+
 void AIStatefulTask::add_task_to_thread_pool(AIQueueHandle queue_handle, uint8_t const failure_count)
 {
   DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::add_task_to_thread_pool(" << queue_handle << ", " << (int)failure_count << ")");
+  // Thread confined tasks can not run in the thread pool.
+  ASSERT(!mThreadConfined);
+
+  // Don't let tasks with a higher priority wait for us because we run in a low priority queue.
+  queue_handle = inherit_priority(queue_handle);
 
   // Add the task to the thread pool.
   AIThreadPool& thread_pool{AIThreadPool::instance()};
@@ -1029,20 +1293,35 @@ void AIStatefulTask::add_task_to_thread_pool(AIQueueHandle queue_handle, uint8_t
     length = access.length();
     if (length < capacity) // Buffer not full?
     {
-      boost::intrusive_ptr<AIStatefulTask> task(this);
+      uint64_t const ticket = new_thread_pool_entry(queue_handle);
       access.move_in(
-          [task]()
+          [task = boost::intrusive_ptr<AIStatefulTask>(this), ticket]()
           {
-            // FIXME: I am not sure if the following is correct? It seems not, because
-            // this task is now being added to the thread pool. If before it is executed
-            // the current_handler is set to an engine then due to the line below it
-            // would run in that engine?!
+            uint64_t entry = task->mThreadPoolEntry.load(std::memory_order_acquire);
+            for (;;)
+            {
+              // Bail if this entry was replaced by a newer one (see boost_priority).
+              if ((entry & tpe_ticket_mask) != ticket)
+                return false;
+              if ((entry & tpe_running))
+              {
+                // The task is still being run from its previous entry. Instead of trying again later,
+                // leave it to that thread to add the task again (see release_thread_pool_entry).
+                if (task->mThreadPoolEntry.compare_exchange_weak(entry, entry | tpe_rerun, std::memory_order_relaxed, std::memory_order_acquire))
+                  return false;
+              }
+              else if (task->mThreadPoolEntry.compare_exchange_weak(entry, (entry & ~tpe_queued) | tpe_running, std::memory_order_acquire, std::memory_order_acquire))
+                break;
+            }
             Handler const handler{multiplex_state_type::crat(task->mState)->current_handler};
-            // While if in the meantime current_handler is set to idle, then we need to bail.
-            if (!handler)
-              return false;
-            task->insert_multiplex(normal_run, handler);
-            return task->active(handler);
+            // If in the meantime current_handler was set to idle (or to an engine, which then runs the task) then we need to bail.
+            bool active = handler.is_thread_pool();
+            if (active)
+            {
+              task->insert_multiplex(normal_run, handler);
+              active = task->active(handler);
+            }
+            return task->release_thread_pool_entry(ticket, handler, active);
           }
       );
     }
@@ -1090,9 +1369,96 @@ void AIStatefulTask::add_task_to_thread_pool(AIQueueHandle queue_handle, uint8_t
     queue.notify_one();
 }
 
+uint64_t AIStatefulTask::new_thread_pool_entry(AIQueueHandle queue_handle)
+{
+  uint64_t const queue_bits = static_cast<uint64_t>(queue_handle.get_value()) << tpe_queue_shift;
+  ASSERT((queue_bits & ~tpe_queue_mask) == 0);
+  uint64_t entry = mThreadPoolEntry.load(std::memory_order_relaxed);
+  uint64_t ticket;
+  // Keep tpe_running: the new entry may only run the task after the thread that is running it now is done.
+  do
+    ticket = (entry & tpe_ticket_mask) + tpe_ticket_unit;
+  while (!mThreadPoolEntry.compare_exchange_weak(entry, ticket | (entry & tpe_running) | tpe_queued | queue_bits, std::memory_order_release, std::memory_order_relaxed));
+  return ticket;
+}
+
+bool AIStatefulTask::release_thread_pool_entry(uint64_t ticket, Handler handler, bool active)
+{
+  uint64_t entry = mThreadPoolEntry.load(std::memory_order_relaxed);
+  for (;;)
+  {
+    if ((entry & tpe_ticket_mask) != ticket)
+    {
+      // The task was added to the thread pool again while we were running it; that entry takes over.
+      entry = mThreadPoolEntry.fetch_and(~(tpe_running | tpe_rerun), std::memory_order_release);
+      if (AI_UNLIKELY(entry & tpe_rerun))
+      {
+        // That entry was already taken out of its queue while we were still running the task, and returned without running it.
+        AIQueueHandle const queue_handle(static_cast<std::size_t>((entry & tpe_queue_mask) >> tpe_queue_shift));
+        add_task_to_thread_pool(queue_handle);
+      }
+      return false;
+    }
+    bool const boost = (entry & tpe_boost);
+    // If the task has to run again in the same queue then the entry is queued again (see the return value).
+    uint64_t const released = (entry & ~(tpe_running | tpe_boost)) | ((active && !boost) ? tpe_queued : 0);
+    if (mThreadPoolEntry.compare_exchange_weak(entry, released, std::memory_order_release, std::memory_order_relaxed))
+      break;
+  }
+  if (AI_UNLIKELY(entry & tpe_boost) && active)
+  {
+    // A task with a higher priority started to wait for a mutex that we hold while we were running.
+    add_task_to_thread_pool(handler.get_queue_handle());
+    return false;
+  }
+  return active;
+}
+
+void AIStatefulTask::boost_priority()
+{
+  uint64_t entry = mThreadPoolEntry.load(std::memory_order_acquire);
+  while ((entry & tpe_running))
+  {
+    // Let the thread that is running us take care of it (see release_thread_pool_entry).
+    if ((entry & tpe_boost) || mThreadPoolEntry.compare_exchange_weak(entry, entry | tpe_boost, std::memory_order_relaxed))
+      return;
+  }
+  // If we aren't waiting in a thread pool queue then the priority is inherited when we are added to one.
+  if (!(entry & tpe_queued))
+    return;
+  AIQueueHandle const queue_handle(static_cast<std::size_t>((entry & tpe_queue_mask) >> tpe_queue_shift));
+  if (inherit_priority(queue_handle) == queue_handle)
+    return;
+  Dout(dc::statefultask(mSMDebug), "Moving task out of queue " << queue_handle << " because a task with a higher priority is waiting for a mutex that it holds [" << (void*)this << "]");
+  // This adds a new entry to the queue with the higher priority; the one in queue_handle becomes stale.
+  add_task_to_thread_pool(queue_handle);
+}
+
+AIQueueHandle AIStatefulTask::inherit_priority(AIQueueHandle queue_handle) const
+{
+  // Most tasks don't hold a mutex.
+  if (!mHeldMutexes.load(std::memory_order_relaxed))
+    return queue_handle;
+  // Queues with a lower index have a higher priority.
+  std::size_t const waiter_priority = AIStatefulTaskMutex::held_waiter_priority(this);
+  if (waiter_priority < queue_handle.get_value())
+  {
+    Dout(dc::statefultask(mSMDebug), "Inheriting priority of queue " << waiter_priority << " from a task waiting for a mutex that we hold [" << (void*)this << "]");
+    queue_handle = AIQueueHandle(waiter_priority);
+  }
+  return queue_handle;
+}
+
 AIStatefulTask::state_type AIStatefulTask::begin_loop()
 {
   sub_state_type::wat sub_state_w(mSubState);
+  // The task woke up; if that was because of another condition than the timeout of wait_for, then the timeout is no longer relevant.
+  if (AI_UNLIKELY(mTimerArmed))
+  {
+    // Setting this while holding the lock on mSubState guarantees that the timer won't wake up a later wait.
+    mCold->timer_wait_ended = true;
+    cancel_timer();
+  }
   // Mark that we're about to honor all previous run requests.
   sub_state_w->need_run = false;
 #if CW_DEBUG
@@ -1105,6 +1471,8 @@ AIStatefulTask::state_type AIStatefulTask::begin_loop()
 #if CW_DEBUG
   // Mark that we're running the loop.
   mThreadId = std::this_thread::get_id();
+  // A thread confined task may only run in the thread that it is confined to.
+  ASSERT(!mThreadConfined || mThreadId == mConfinedThreadId);
   // This point marks handling wait() with pending signal().
   mDebugShouldRun |= mDebugSignalPending;
   mDebugSignalPending = false;
@@ -1152,12 +1520,12 @@ void AIStatefulTask::run(Handler default_handler, AIStatefulTask* parent, condit
     // Can only be run when in one of these states.
     ASSERT(state_r->base_state == bs_reset || state_r->base_state == bs_finish || state_r->base_state == bs_callback);
     // Must be the first time we're being run, or we must be called from finish_impl or a callback function.
-    ASSERT(!(state_r->base_state == bs_reset && (mParent || mCallback)));
+    ASSERT(!(state_r->base_state == bs_reset && mCold && (mCold->parent || mCold->callback)));
   }
 #endif
 
   // Do not change the mDefaultHandler when we're run() from a callback.
-  if (!(mParent || mCallback) || !default_handler.is_immediate())
+  if (!(mCold && (mCold->parent || mCold->callback)) || !default_handler.is_immediate())
   {
     // Store the requested default handler.
     mDefaultHandler = default_handler;
@@ -1171,19 +1539,20 @@ void AIStatefulTask::run(Handler default_handler, AIStatefulTask* parent, condit
   // Allow nullptr to be passed as parent to signal that we want to reuse the old one.
   if (parent)
   {
-    mParent = parent;
+    cold_state_st& cold = cold_state();
+    cold.parent = parent;
     // In that case remove any old callback!
-    if (mCallback)
-      mCallback = nullptr;
+    if (cold.callback)
+      cold.callback = nullptr;
 
-    mParentCondition = condition;
-    mOnAbort = on_abort;
+    cold.parent_condition = condition;
+    cold.on_abort = on_abort;
   }
 
   // If abort_parent is requested then a parent must be provided.
-  ASSERT(on_abort == do_nothing || mParent);
+  ASSERT(on_abort == do_nothing || (mCold && mCold->parent));
   // If a parent is provided, it must be running.
-  ASSERT(!mParent || mParent->running());
+  ASSERT(!mCold || !mCold->parent || mCold->parent->running());
 
   // Start from the beginning.
   reset();
@@ -1202,7 +1571,7 @@ void AIStatefulTask::run(Handler default_handler, std::function<void (bool)> cb_
     // Can only be run when in one of these states.
     ASSERT(state_r->base_state == bs_reset || state_r->base_state == bs_finish || state_r->base_state == bs_callback);
     // Must be the first time we're being run, or we must be called from finish_impl or a callback function.
-    ASSERT(!(state_r->base_state == bs_reset && (mParent || mCallback)));
+    ASSERT(!(state_r->base_state == bs_reset && mCold && (mCold->parent || mCold->callback)));
   }
 #endif
 
@@ -1212,11 +1581,13 @@ void AIStatefulTask::run(Handler default_handler, std::function<void (bool)> cb_
   // Initialize sleep timer.
   mSleep = 0;
 
+  cold_state_st& cold = cold_state();
+
   // Clean up any old callbacks.
-  mParent = nullptr;
+  cold.parent = nullptr;
 
   // Create new call back.
-  mCallback = std::move(cb_function);
+  cold.callback = std::move(cb_function);
 
   // Start from the beginning.
   reset();
@@ -1226,38 +1597,46 @@ void AIStatefulTask::callback()
 {
   DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::callback() [" << (void*)this << "]");
 
+  // Nothing to do if run() was never passed a parent or callback.
+  if (!mCold)
+    return;
+
+  // Stop the timer of a wait_for that was ended by another condition.
+  stop_timer();
+
+  cold_state_st& cold = *mCold;
   bool aborted = sub_state_type::rat(mSubState)->aborted;
-  if (mParent)
+  if (cold.parent)
   {
     // It is possible that the parent is not running when the parent is in fact aborting and called
     // abort on this object from it's abort_impl function. It that case we don't want to recursively
     // call abort again (or change it's state).
-    if (mParent->running())
+    if (cold.parent->running())
     {
-      if (aborted && mOnAbort == abort_parent)
+      if (aborted && cold.on_abort == abort_parent)
       {
-        mParent->abort();
-        mParent = nullptr;
+        cold.parent->abort();
+        cold.parent = nullptr;
       }
-      else if (!aborted || mOnAbort == signal_parent)
+      else if (!aborted || cold.on_abort == signal_parent)
       {
-        mParent->signal(mParentCondition);
+        cold.parent->signal(cold.parent_condition);
       }
     }
   }
-  if (mCallback)
+  if (cold.callback)
   {
-    mCallback(!aborted);
+    cold.callback(!aborted);
     if (!sub_state_type::rat(mSubState)->reset) // run() wasn't called from the callback (or before from finish())?
     {
-      mCallback = nullptr;
-      mParent = nullptr;
+      cold.callback = nullptr;
+      cold.parent = nullptr;
     }
   }
   else
   {
     // Not restarted by callback. Allow run() to be called later on.
-    mParent = nullptr;
+    cold.parent = nullptr;
   }
 }
 
@@ -1640,7 +2019,7 @@ void AIStatefulTask::wait_until(std::function<bool()> const& wait_condition, con
 // This function causes the task to do at least one full run of multiplex(), provided we are
 // currently idle as a result of a call to wait() with the same condition.
 // Returns true if the stateful task was unblocked, false if it was already unblocked.
-bool AIStatefulTask::signal(condition_type condition)
+bool AIStatefulTask::do_signal(condition_type condition, event_type event)
 {
   DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::signal(" << print_conditions(condition) << ") [" << (void*)this << "]");
   // It is not allowed to call this function with an empty mask.
@@ -1682,11 +2061,122 @@ bool AIStatefulTask::signal(condition_type condition)
     // Note that this call to multiplex can be ignored when the task is already running;
     // this is why need_run was set: in that case the thread that is already running this
     // task will start multiplex() from the top once it reaches the end.
-    insert_multiplex(schedule_run);
+    insert_multiplex(event);
   }
   return true;
 }
 
+void AIStatefulTask::wait_for(condition_type conditions, threadpool::Timer::Interval const& interval)
+{
+  DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::wait_for(" << print_conditions(conditions) << ", interval) [" << (void*)this << "]");
+  // The timer would signal the task from another thread.
+  ASSERT(!mThreadConfined);
+  cold_state_st& cold = cold_state();
+  if (!cold.timer)
+    cold.timer.emplace([this](){ timer_expired(); });
+  else
+    stop_timer();
+  cold.timed_out.store(false, std::memory_order_relaxed);
+  {
+    sub_state_type::wat sub_state_w(mSubState);
+    cold.timer_wait_ended = false;
+  }
+  cold.timer_state.store(timer_armed, std::memory_order_relaxed);
+  mTimerArmed = true;
+  cold.timer->start(interval);
+  wait(conditions);
+}
+
+void AIStatefulTask::timer_expired()
+{
+  cold_state_st& cold = *mCold;
+  int expected = timer_armed;
+  // Do nothing if the timer was cancelled or is being stopped.
+  if (!cold.timer_state.compare_exchange_strong(expected, timer_firing, std::memory_order_acquire))
+    return;
+  // The task can't be destructed while timer_state is timer_firing (stop_timer waits for us),
+  // but we still need it after resetting timer_state, to notify stop_timer.
+  boost::intrusive_ptr<AIStatefulTask> keep_alive(this);
+  bool wake_up = false;
+  {
+    sub_state_type::wat sub_state_w(mSubState);
+    // Only wake up the task if it is still waiting in the wait_for that started the timer.
+    // Unlike signal(), do nothing at all otherwise: a later wait must not see a signal of this timer.
+    condition_type const waiting_for = sub_state_w->idle & OR_conditions_mask;
+    if (!cold.timer_wait_ended && waiting_for)
+    {
+      Dout(dc::statefultask(mSMDebug), "Timeout of wait_for: waking up the task [" << (void*)this << "]");
+      cold.timed_out.store(true, std::memory_order_release);
+      // As if all conditions that the task is waiting for were signaled (the AND conditions still have to be signaled).
+      sub_state_w->idle &= ~waiting_for;
+      wake_up = !sub_state_w->idle;
+      if (wake_up)
+      {
+#if CW_DEBUG
+        mDebugSignalPending = sub_state_w->wait_called;
+#endif
+        sub_state_w->need_run = true;
+      }
+    }
+  }
+  if (wake_up && !mMultiplexMutex.is_self_locked())
+  {
+    // This might run the task in this thread, in which case stop_timer() is called from inside
+    // insert_multiplex (see tl_timer_expiring_task).
+    AIStatefulTask const* outer_expiring_task = tl_timer_expiring_task;
+    tl_timer_expiring_task = this;
+    insert_multiplex(schedule_run);
+    tl_timer_expiring_task = outer_expiring_task;
+  }
+  // Unless stop_timer() already reset timer_state from inside the signal, tell it that we're done.
+  expected = timer_firing;
+  if (cold.timer_state.compare_exchange_strong(expected, timer_idle, std::memory_order_release))
+    cold.timer_state.notify_all();
+}
+
+void AIStatefulTask::cancel_timer()
+{
+  // Only called from begin_loop (while holding mMultiplexMutex and the lock on mState).
+  // Since timer_expired() needs the lock on mState to signal us, we can't stop the timer
+  // here (nor wait for timer_expired() to finish); that is left to stop_timer.
+  int expected = timer_armed;
+  mCold->timer_state.compare_exchange_strong(expected, timer_cancelled, std::memory_order_relaxed);
+}
+
+void AIStatefulTask::stop_timer()
+{
+  // Only called from multiplex (while holding mMultiplexMutex, but not the lock on mState).
+  if (!mTimerArmed)
+    return;
+  mTimerArmed = false;
+  cold_state_st& cold = *mCold;
+  int expected = timer_armed;
+  if (cold.timer_state.compare_exchange_strong(expected, timer_idle, std::memory_order_acq_rel))
+    cold.timer->stop();
+  else if (expected == timer_cancelled)
+  {
+    // The task was woken up by another condition (see cancel_timer); the timer might still be running.
+    cold.timer_state.store(timer_idle, std::memory_order_relaxed);
+    cold.timer->stop();
+  }
+  else if (tl_timer_expiring_task == this)
+  {
+    // We are run by the signal of timer_expired(), from this thread: the timer is done.
+    cold.timer_state.store(timer_idle, std::memory_order_relaxed);
+  }
+  else
+  {
+    // The timer expired and timer_expired() is signaling us from another thread. Wait until it is done,
+    // so that no signal of this timer can arrive after we return. That doesn't take long: because we
+    // hold mMultiplexMutex that signal() doesn't run the task.
+    while (expected == timer_firing)
+    {
+      cold.timer_state.wait(timer_firing, std::memory_order_acquire);
+      expected = cold.timer_state.load(std::memory_order_acquire);
+    }
+  }
+}
+
 void AIStatefulTask::abort()
 {
   DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::abort() [" << (void*)this << "]");
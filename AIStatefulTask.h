@@ -51,9 +51,13 @@
 #include "utils/is_power_of_two.h"
 #include "debug.h"
 #include <list>
+#include <optional>
+#include <atomic>
+#include <memory>
 #include <chrono>
 #include <functional>
 #include <tuple>
+#include <iosfwd>
 #ifdef TRACY_FIBERS
 #include <Tracy.hpp>
 #include <cstring>
@@ -116,6 +120,7 @@ class AIStatefulTask : public AIRefCount
   enum event_type {
     initial_run,              ///< The user called @c run, directly after creating a task.
     schedule_run,             ///< The user called signal(condition_type) with a condition that the task was waiting for.
+    handoff_run,              ///< The user called signal_handoff(condition_type) with a condition that the task was waiting for.
     normal_run,               ///< Called from AIEngine::mainloop for tasks in the engines queue.
     insert_abort              ///< Called from abort() when that is called on a waiting task.
   };
@@ -152,6 +157,8 @@ class AIStatefulTask : public AIRefCount
    * should run in the thread that calls run() or the thread that wakes up a task
    * by calling signal(). Hence, this handler causes a task to run to until
    * the first time it goes idle, or calls @c yield, before returning from @c run / @c signal respectively.
+   * The exception being when the thread is already running deeply nested tasks: then the task is
+   * run by the outermost task of that thread, after that returned from multiplex, to bound the stack depth.
    *
    * When a Handler is constructed from an AIEngine pointer, then it describes that
    * a task should run in that engine.
@@ -249,9 +256,9 @@ class AIStatefulTask : public AIRefCount
 #ifndef DOXYGEN
   struct multiplex_state_st {
     base_state_type base_state;
+    condition_type conditions;          // Placed here to fill the padding in front of current_handler (see AIStatefulTask::Layout).
     Handler current_handler;            // Current handler.
     AIWaitConditionFunc wait_condition;
-    condition_type conditions;
     multiplex_state_st() : base_state(bs_reset), current_handler(Handler::idle), wait_condition(nullptr) { }
   };
 
@@ -269,7 +276,62 @@ class AIStatefulTask : public AIRefCount
 #endif
   };
 
+#endif // DOXYGEN
+
  private:
+  using clock_type = std::chrono::steady_clock;
+  using duration_type = clock_type::duration;
+
+  // The states of the timer of wait_for.
+  enum timer_state_type {
+    timer_idle,                 // The timer isn't running, or was stopped.
+    timer_armed,                // The timer is running.
+    timer_cancelled,            // The task woke up for another reason; the expiration of the timer must be ignored (the timer wasn't stopped yet).
+    timer_firing                // The timer expired and is signaling the task.
+  };
+
+  // Rarely used state. Allocated out of line by the first run() that needs it and then reused until the task is destructed.
+  struct cold_state_st
+  {
+    // Callback facilities.
+    // From within an other stateful task:
+    boost::intrusive_ptr<AIStatefulTask> parent;        // The parent object that started this task, or nullptr if there isn't any.
+    condition_type parent_condition;                    // The condition (bit) that the parent should be signaled with upon a successful finish.
+    on_abort_st on_abort;                               // What to do with the parent (if any) when aborted.
+    // From outside a stateful task:
+    std::function<void (bool)> callback;                // Pointer to signal/connection, or nullptr when not connected.
+
+    // Timeout facilities (see wait_for).
+    std::optional<threadpool::Timer> timer;             // Constructed by the first call to wait_for.
+    std::atomic<int> timer_state;                       // One of timer_state_type.
+    std::atomic<bool> timed_out;                        // Set when the task was woken up by the timer of the last call to wait_for.
+    bool timer_wait_ended;                              // Set when the task ran after the last call to wait_for. Protected by the lock on mSubState.
+
+    cold_state_st() : parent_condition(0), on_abort(do_nothing), timer_state(timer_idle), timed_out(false), timer_wait_ended(true) { }
+  };
+
+  // The members below, up till and including mSubState, are accessed every time the task runs.
+  // They are contiguous, start in the first cache line of the object and span at most four
+  // cache lines (this is checked in AIStatefulTask.cxx; print_layout_on reports the actual offsets).
+  //
+  // mSleep, the handlers, mYield and mTimerArmed are protected by mMultiplexMutex.
+  clock_type::rep mSleep;             // Non-zero while the task is sleeping. Negative means frames, positive means clock periods.
+
+  // Engine stuff.
+  Handler mDefaultHandler;            // Default engine or queue.
+  Handler mTargetHandler;             // Requested engine by a call to yield.
+
+  bool mYield;                        // True when any yield function was called, except for yield_if_not when the passed engine already matched.
+  bool mTimerArmed;                   // Set by wait_for, reset by stop_timer: the timer in mCold might still be running.
+
+  // Thread confinement. These two fill (like mTimerArmed) the padding in front of mMultiplexMutex, so they don't make the task any larger.
+  bool mThreadConfined;               // Set by set_thread_confined(): all references to this task are taken and released by a single thread.
+  mutable int mConfinedRefCount;      // The number of boost::intrusive_ptr's to this task while mThreadConfined is set.
+
+  // Mutex protecting mSleep, the handlers, mYield and mCold, and making sure only one thread runs the task at a time.
+  AIMutex mMultiplexMutex;
+
+#ifndef DOXYGEN
   // Base state.
   using multiplex_state_type = aithreadsafe::Wrapper<multiplex_state_st, aithreadsafe::policy::Primitive<std::mutex>>;
   multiplex_state_type mState;
@@ -280,29 +342,31 @@ class AIStatefulTask : public AIRefCount
   sub_state_type mSubState;
 #endif // DOXYGEN
 
+  // Everything below is not accessed on every run.
  private:
-  // Mutex protecting everything below and making sure only one thread runs the task at a time.
-  AIMutex mMultiplexMutex;
   // Mutex that is locked while calling *_impl() functions and the call back.
   std::recursive_mutex mRunMutex;
 
-  using clock_type = std::chrono::steady_clock;
-  using duration_type = clock_type::duration;
+  std::unique_ptr<cold_state_st> mCold;                 // The parent and/or callback, or nullptr if run() was never called with either.
 
-  clock_type::rep mSleep;   ///< Non-zero while the task is sleeping. Negative means frames, positive means clock periods.
+  duration_type mDuration;            // Total time spent running in the main thread.
 
-  // Callback facilities.
-  // From within an other stateful task:
-  boost::intrusive_ptr<AIStatefulTask> mParent;       // The parent object that started this task, or nullptr if there isn't any.
-  condition_type mParentCondition;                    // The condition (bit) that the parent should be signaled with upon a successful finish.
-  on_abort_st mOnAbort;                               // What to do with the parent (if any) when aborted.
-  // From outside a stateful task:
-  std::function<void (bool)> mCallback;               // Pointer to signal/connection, or nullptr when not connected.
+  std::atomic<AIStatefulTaskMutex*> mHeldMutexes;       // The mutexes held by this task that tasks with a priority wait for, linked through AIStatefulTaskMutex::m_next_held (used for priority inheritance).
 
-  // Engine stuff.
-  Handler mDefaultHandler;            // Default engine or queue.
-  Handler mTargetHandler;             // Requested engine by a call to yield.
-  bool mYield;                        // True when any yield function was called, except for yield_if_not when the passed engine already matched.
+  // The entry of this task in the thread pool (see add_task_to_thread_pool).
+  // Only the entry with the current ticket runs the task; older entries return without doing anything.
+  std::atomic<uint64_t> mThreadPoolEntry;
+
+  AIStatefulTask* mNextRun;           // The next task in tl_deferred_head or tl_handoff_head, this task if it is the last one, or nullptr if it isn't in a list.
+  event_type mDeferredEvent;          // The event to pass to multiplex() while this task is in tl_deferred_head.
+  static constexpr uint64_t tpe_running = 1;            // A thread is running the task from its entry.
+  static constexpr uint64_t tpe_boost = 2;              // boost_priority() was called while running: the task must be moved to a higher priority queue.
+  static constexpr uint64_t tpe_queued = 4;             // The entry is waiting in a thread pool queue.
+  static constexpr uint64_t tpe_rerun = 8;              // The current entry found the task running from an older entry: the thread that runs it must add it again.
+  static constexpr int tpe_queue_shift = 4;             // Bits [4, 16) are the index of that queue.
+  static constexpr uint64_t tpe_queue_mask = uint64_t{0xfff} << tpe_queue_shift;
+  static constexpr uint64_t tpe_ticket_unit = uint64_t{1} << 16;       // The remaining bits are the ticket.
+  static constexpr uint64_t tpe_ticket_mask = ~(tpe_ticket_unit - 1);
 
 #if CW_DEBUG
   // Debug stuff.
@@ -313,9 +377,21 @@ class AIStatefulTask : public AIRefCount
   bool mDebugSignalPending;           // True while wait() was called but didn't get idle because of a pending call to signal() that wasn't handled yet.
   bool mDebugSetStatePending;         // True while set_state() was called by not handled yet.
   bool mDebugRefCalled;               // True when ref() is called (or will be called within the critial area of mMultiplexMutex).
+  std::thread::id mConfinedThreadId;  // The thread that called set_thread_confined().
 #endif
 
   static thread_local AIStatefulTask* tl_parent_task;
+  static thread_local AIStatefulTask const* tl_timer_expiring_task;     // The task that timer_expired() is signaling from this thread, if any.
+
+  // Trampoline for nested immediate runs, and tasks that were handed off (see insert_multiplex).
+  // Both are singly linked lists through mNextRun, that own a reference to the tasks in them.
+  static constexpr int max_multiplex_depth = 32;    // The number of nested calls to multiplex() beyond which runs are deferred.
+  static thread_local int tl_multiplex_depth;       // The number of nested initial, schedule, hand-off and abort runs on the stack of the current thread.
+  static thread_local AIStatefulTask* tl_deferred_head;         // The runs that were deferred because tl_multiplex_depth was too large.
+  static thread_local AIStatefulTask* tl_deferred_tail;
+  static thread_local AIStatefulTask* tl_handoff_head;          // The tasks that were handed off to this thread (see signal_handoff).
+  static thread_local AIStatefulTask* tl_handoff_tail;
+  static thread_local Handler tl_running_handler;   // The handler of the normal_run that the current thread is doing, or idle.
 
 #if defined(CWDEBUG) && !defined(DOXYGEN)
  protected:
@@ -327,7 +403,16 @@ class AIStatefulTask : public AIRefCount
 #endif
 
  private:
-  duration_type mDuration;            // Total time spent running in the main thread.
+  // Checks the layout of this class at compile time (see AIStatefulTask.cxx).
+  struct Layout;
+
+  // Return the cold state, allocating it if that didn't happen yet.
+  cold_state_st& cold_state()
+  {
+    if (AI_UNLIKELY(!mCold))
+      mCold.reset(new cold_state_st);
+    return *mCold;
+  }
 
 #ifdef TRACY_FIBERS
  protected:
@@ -349,18 +434,18 @@ class AIStatefulTask : public AIRefCount
    * The following parameter is only available in debug mode.
    * @param debug Write debug output for this task to dc::statefultask.
    */
-  AIStatefulTask(CWDEBUG_ONLY(bool debug)) : mDefaultHandler(Handler::idle), mTargetHandler(Handler::idle), mYield(false),
+  AIStatefulTask(CWDEBUG_ONLY(bool debug)) : mDefaultHandler(Handler::idle), mTargetHandler(Handler::idle),
+  mYield(false), mTimerArmed(false), mThreadConfined(false), mConfinedRefCount(0), mDuration(duration_type::zero()), mHeldMutexes(nullptr), mThreadPoolEntry(0), mNextRun(nullptr), mDeferredEvent(normal_run)
 #if CW_DEBUG
-  mDebugLastState(bs_killed), mDebugShouldRun(false), mDebugAborted(false), mDebugSignalPending(false),
-  mDebugSetStatePending(false), mDebugRefCalled(false),
+  , mDebugLastState(bs_killed), mDebugShouldRun(false), mDebugAborted(false), mDebugSignalPending(false),
+  mDebugSetStatePending(false), mDebugRefCalled(false)
 #endif
 #ifdef CWDEBUG
-  mSMDebug(debug),
+  , mSMDebug(debug)
 #endif
 #if CW_DEBUG
-  m_may_not_be_deleted(false),
+  , m_may_not_be_deleted(false)
 #endif
-  mDuration(duration_type::zero())
 #ifdef TRACY_FIBERS
   , m_tracy_fiber_name(nullptr)
 #endif
@@ -388,6 +473,11 @@ class AIStatefulTask : public AIRefCount
    * Start a new task or restart an existing task that just finished.
    * These functions may be called directly after creation, or from within @link Example::finish_impl finish_impl @endlink, or from the call back function.
    *
+   * With the @link AIStatefulTask::Handler::immediate_h immediate @endlink Handler the task normally
+   * runs before run() returns. However, when the calling thread is already running max_multiplex_depth (32)
+   * nested tasks, the first run is deferred to avoid a stack overflow: it then happens after the outermost
+   * task that this thread is running returned. So don't rely on the task having run when run() returns.
+   *
    * @sa page_default_engine
    */
 
@@ -442,8 +532,72 @@ class AIStatefulTask : public AIRefCount
    * @link group_run run@endlink from @link Example::finish_impl finish_impl@endlink).
    */
   void kill();
+
+  /**
+   * Declare that this task is confined to the calling thread.
+   *
+   * After calling this, all boost::intrusive_ptr's to this task must be
+   * created, copied and destroyed by the calling thread, and the task may
+   * only run in that thread: with the @link AIStatefulTask::Handler::immediate_h immediate @endlink
+   * Handler or in an AIEngine whose mainloop is called by that thread.
+   * In return the reference counting of the task no longer uses atomic operations.
+   *
+   * This may only be called directly after creation, while the caller holds
+   * the only boost::intrusive_ptr to the task. Debug builds assert on any
+   * reference count change or run from another thread; release builds do not
+   * check this at all, there such a violation silently corrupts the reference count.
+   *
+   * Tasks that are shared between threads by design, like the tasks of a
+   * task::Broker, can therefore not be thread confined.
+   */
+  void set_thread_confined()
+  {
+    // Only the boost::intrusive_ptr returned by create() may exist; it becomes the first confined reference.
+    ASSERT(unique() && !mThreadConfined);
+#if CW_DEBUG
+    ASSERT(multiplex_state_type::crat(mState)->base_state == bs_reset);
+    mConfinedThreadId = std::this_thread::get_id();
+#endif
+    mConfinedRefCount = 1;
+    mThreadConfined = true;
+  }
+
+  /// Return true if set_thread_confined() was called.
+  bool is_thread_confined() const { return mThreadConfined; }
+
+  /// Return true if there is exactly one boost::intrusive_ptr to this task.
+  /// This hides AIRefCount::unique, which doesn't see the references that are counted in mConfinedRefCount.
+  bool unique() const { return AIRefCount::unique() && (!mThreadConfined || mConfinedRefCount == 1); }
   ///@}
 
+#ifndef DOXYGEN
+  // While thread confined, the reference count is kept in a plain int and only
+  // the transitions between zero and one are passed on to the atomic AIRefCount.
+  friend void intrusive_ptr_add_ref(AIStatefulTask const* task)
+  {
+    if (AI_UNLIKELY(task->mThreadConfined))
+    {
+      // A thread confined task may only be referenced by the thread that it is confined to.
+      ASSERT(task->mConfinedThreadId == std::this_thread::get_id());
+      if (task->mConfinedRefCount++ > 0)
+        return;
+    }
+    intrusive_ptr_add_ref(static_cast<AIRefCount const*>(task));
+  }
+
+  friend void intrusive_ptr_release(AIStatefulTask const* task)
+  {
+    if (AI_UNLIKELY(task->mThreadConfined))
+    {
+      ASSERT(task->mConfinedThreadId == std::this_thread::get_id());
+      ASSERT(task->mConfinedRefCount > 0);
+      if (--task->mConfinedRefCount > 0)
+        return;
+    }
+    intrusive_ptr_release(static_cast<AIRefCount const*>(task));
+  }
+#endif
+
  protected:
   /**
    * @addtogroup group_protected Protected control functions.
@@ -515,6 +669,45 @@ class AIStatefulTask : public AIRefCount
     wait_until(wait_condition, conditions);
   }
 
+  /**
+   * Wait for @a conditions, but no longer than @a interval.
+   *
+   * Like wait(conditions), except that the task also wakes up when
+   * @a interval passed, as if one of @a conditions was signaled.
+   * Use timed_out() to find out if that is why the task woke up.
+   * No condition bit is reserved for this: the timer only wakes up the task
+   * if it is still waiting in this call, so it never leaves a pending signal behind.
+   *
+   * No extra task is created: the timer is part of the task and is reused by subsequent calls.
+   * When the task wakes up for any reason, an expiration of the timer is ignored from then on;
+   * the timer itself is stopped by the next call to wait_for and when the task finishes.
+   *
+   * There is no wait_until_time(conditions, time_point): threadpool::Timer only runs its
+   * predefined Interval's, so it can't be armed for an arbitrary deadline.
+   *
+   * Thread confined tasks can't use this function, because the timer signals the task from another thread.
+   *
+   * @param conditions A bit mask of conditions to wait for.
+   * @param interval The maximum time to wait.
+   */
+  void wait_for(condition_type conditions, threadpool::Timer::Interval const& interval);
+
+  /**
+   * Wait for @a conditions, but no longer than @a interval, and then continue with @a new_state.
+   *
+   * @param conditions A bit mask of conditions to wait for.
+   * @param interval The maximum time to wait.
+   * @param new_state The new state to continue with.
+   */
+  void wait_for(condition_type conditions, threadpool::Timer::Interval const& interval, state_type new_state)
+  {
+    set_state(new_state);
+    wait_for(conditions, interval);
+  }
+
+  /// Return true if the task was woken up by the timer of the last call to wait_for.
+  bool timed_out() const { return mCold && mCold->timed_out.load(std::memory_order_acquire); }
+
   ///@} // group_wait
 
   /**
@@ -644,10 +837,30 @@ class AIStatefulTask : public AIRefCount
    * Guarantee at least one full run of @a multiplex iff this task is still blocked since
    * the last call to <code>wait(conditions)</code> where <code>(conditions & condition) != 0</code>.
    *
+   * If the task uses the immediate handler then that run normally happens before signal returns,
+   * but not when the calling thread is already running max_multiplex_depth (32) nested tasks:
+   * then the run is deferred until the outermost task that this thread is running returned
+   * (see also @link group_run run@endlink).
+   *
+   * @param condition The condition that might have changed, or that the task is waiting for.
+   * @returns false if it already unblocked or is waiting on (a) different condition(s) now.
+   */
+  bool signal(condition_type condition) { return do_signal(condition, schedule_run); }
+
+  /**
+   * Wake up a waiting task and, if possible, continue it in the current thread.
+   *
+   * The same as @ref signal, except when this wakes up the task and the task has to run in the
+   * same engine or thread pool queue as the task that is currently run by this thread (from
+   * AIEngine::mainloop or the thread pool). In that case the task is not added to that engine
+   * or queue, but run by this thread directly after the current task returns from @c multiplex.
+   *
+   * This is used by AIStatefulTaskMutex, in hand-off mode, to pass the lock to the next task.
+   *
    * @param condition The condition that might have changed, or that the task is waiting for.
    * @returns false if it already unblocked or is waiting on (a) different condition(s) now.
    */
-  bool signal(condition_type condition);
+  bool signal_handoff(condition_type condition) { return do_signal(condition, handoff_run); }
 
   ///@} // group_public
 
@@ -716,7 +929,7 @@ class AIStatefulTask : public AIRefCount
   bool finished() const
   {
     sub_state_type::crat sub_state_r(mSubState);
-    return sub_state_r->finished ? &AIStatefulTask::mOnAbort : 0;
+    return sub_state_r->finished;
   }
 
   /**
@@ -758,6 +971,26 @@ class AIStatefulTask : public AIRefCount
    */
   char const* task_name() const { return task_name_impl(); }
 
+  /**
+   * Write the size of AIStatefulTask and the offset and size of each of its members to @a os.
+   *
+   * The layout itself is checked at compile time (see AIStatefulTask::Layout); this report
+   * makes it easy to see what changed when one of those checks fails, or how much a new member costs.
+   */
+  static void print_layout_on(std::ostream& os);
+
+  /// The numbers that AIStatefulTask::Layout checks, for use by tests.
+  struct layout_st
+  {
+    std::size_t size;                   ///< sizeof(AIStatefulTask).
+    std::size_t hot_begin;              ///< The offset of the first hot member.
+    std::size_t hot_end;                ///< The offset directly behind the last hot member.
+    std::size_t max_hot_size;           ///< The maximum allowed value of hot_end - hot_begin.
+  };
+
+  /// Return the layout of AIStatefulTask.
+  static layout_st layout();
+
  protected:
   /**
    * @{
@@ -804,7 +1037,30 @@ class AIStatefulTask : public AIRefCount
       s_tl_tracy_fiber_name = nullptr;
     }
 #endif
-    multiplex(event, handler);
+    if (event == normal_run)
+    {
+      // Runs from an engine or the thread pool don't recurse, so they don't count towards the depth below.
+      // Remember in which handler this thread is running tasks (see signal_handoff); hand-off is disabled
+      // in the unusual case that a normal_run is done from inside another one.
+      Handler const prev_running_handler = tl_running_handler;
+      tl_running_handler = prev_running_handler ? Handler(Handler::idle) : handler;
+      multiplex(event, handler);
+      if (AI_UNLIKELY(tl_handoff_head))
+        run_handed_off(handler);
+      tl_running_handler = prev_running_handler;
+    }
+    // Running a task with the immediate handler calls multiplex() recursively when that task
+    // runs or signals another task, and so on. Once the recursion depth reaches max_multiplex_depth
+    // new runs are queued instead, and executed in a loop by the outermost call. Aborts are never deferred.
+    else if (AI_UNLIKELY(tl_multiplex_depth >= max_multiplex_depth) && event != insert_abort)
+      defer_multiplex(event);
+    else
+    {
+      ++tl_multiplex_depth;
+      multiplex(event, handler);
+      if (--tl_multiplex_depth == 0 && AI_UNLIKELY(tl_deferred_head))
+        run_deferred_multiplex();
+    }
 #ifdef TRACY_FIBERS
     if (AI_UNLIKELY(parent_tracy_fiber_name))
     {
@@ -815,6 +1071,15 @@ class AIStatefulTask : public AIRefCount
 #endif
   }
 
+  bool do_signal(condition_type condition, event_type event);   // Called by signal() and signal_handoff().
+  void timer_expired();                               // Called by the timer of wait_for when it expired.
+  void cancel_timer();                                // Make the timer of wait_for ignore its expiration (see begin_loop).
+  void stop_timer();                                  // Stop the timer of wait_for, if it is running.
+  void defer_multiplex(event_type event);             // Called from insert_multiplex() to queue a run when the call stack is too deep.
+  void run_deferred_multiplex();                      // Called from the outermost insert_multiplex() to execute the queued runs.
+  void run_handed_off(Handler handler);               // Called from insert_multiplex() after a normal_run to run the tasks that were handed off.
+  static void push_run(AIStatefulTask*& head, AIStatefulTask*& tail, AIStatefulTask* task);  // Append task to a list of runs, taking a reference.
+  static AIStatefulTask* pop_run(AIStatefulTask*& head, AIStatefulTask*& tail);              // Remove the first task from a list of runs; the caller gets its reference.
   state_type begin_loop();                            // Called from multiplex() at the start of a loop.
   void callback();                                    // Called when the task finished.
   // Count frames if necessary and return true when the task is still sleeping.
@@ -835,9 +1100,15 @@ class AIStatefulTask : public AIRefCount
   void add(duration_type delta) { mDuration += delta; }
 
   void add_task_to_thread_pool(AIQueueHandle queue_handle, uint8_t const failure_count = 0);    // Attempt to add this task to a theadpool queue.
+  AIQueueHandle inherit_priority(AIQueueHandle queue_handle) const;                            // Return the highest priority queue of queue_handle and those of tasks waiting for mutexes that we hold.
+  uint64_t new_thread_pool_entry(AIQueueHandle queue_handle);                                  // Replace the entry of this task in the thread pool by one in queue_handle and return its ticket.
+  bool release_thread_pool_entry(uint64_t ticket, Handler handler, bool active);               // Called after running the task from the entry with ticket. Returns true if it must be called again.
+  void boost_priority();                                                                        // Move this task to a higher priority queue if it is waiting in a thread pool queue with a lower priority than it inherits.
   void wait_AND(condition_type required);                                                       // Stop running until all `required` bits have been signaled (plus at least one of any other wait() condition).
 
   friend class AIEngine;      // Calls multiplex(), force_killed() and add().
+  friend class AISharedEngine;        // Idem.
+  friend class AIStatefulTaskMutex;   // Accesses mHeldMutexes and the handlers, and calls boost_priority().
 };
 
 namespace task {
@@ -940,7 +1211,7 @@ boost::intrusive_ptr<TaskType> create_from_tuple(std::tuple<ARGS...>&& args)
 
 utils::FuzzyBool AIStatefulTask::is_self_locked(AIStatefulTaskMutex const& stateful_task_mutex, AIStatefulTaskMutexNode const* handle)
 {
-  return stateful_task_mutex.is_self_locked(handle);
+  return stateful_task_mutex.is_self_locked(this, handle);
 }
 
 #endif // AISTATEFULTASK_H_definitions
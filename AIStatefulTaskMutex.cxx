@@ -28,36 +28,190 @@
 #include "sys.h"
 #include "AIStatefulTaskMutex.h"
 #include "AIStatefulTask.h"
+#include "LockAll.h"
+#include <algorithm>
 
 void AIStatefulTaskMutex::unlock()
 {
   DoutEntering(dc::notice|flush_cf, "AIStatefulTaskMutex::unlock() [mutex:" << this << "]");
 
-  // We are the owner of the lock, hence there is a node in the queue which is the next to pop.
-  Node* owner;
-  while (!(owner = static_cast<Node*>(m_queue.pop())))
-    cpu_relax();
+  // We are the owner of the lock.
+  Node* owner = m_owner.load(std::memory_order_relaxed);
+  ASSERT(owner);
 
-#ifdef CWDEBUG
   AIStatefulTask* const task = owner->m_task;
   Dout(dc::notice, "Mutex released [" << task << "]");
-#endif
 
-  // Free our node.
-  s_node_memory_resource.deallocate(owner);
+  statefultask::MutexProfile::clock_type::time_point now;
+  if (AI_UNLIKELY(m_profile))
+  {
+    now = statefultask::MutexProfile::clock_type::now();
+    m_profile->released(now);
+  }
 
-  // Signal the next owner of the lock, if any.
-  Node const* next = static_cast<Node const*>(m_queue.peek());
+  Node* next = owner->m_next.load(std::memory_order_acquire);
+  if (!next)
+  {
+    // If we are the last node in the queue then the mutex becomes unlocked.
+    m_owner.store(nullptr, std::memory_order_relaxed);
+    // Nobody is waiting anymore (this is a hint: a task that is queuing itself right now might have to raise it again).
+    m_waiter_priority.store(no_waiter_priority, std::memory_order_relaxed);
+    Node* expected = owner;
+    if (m_tail.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel, std::memory_order_relaxed))
+    {
+      // Nobody was queued behind us, so this mutex isn't in the list of mutexes held by task (see boost_owner).
+      // Free our node (m_fast_node can be reused by another thread at this point, but its m_next is already nullptr).
+      if (owner != &m_fast_node)
+        s_node_memory_resource.deallocate(owner);
+      return;
+    }
+  }
 
-  // If this is false (is_stub is true), then it must be guaranteed
-  // that the owner of the front node didn't call push yet, or it did
-  // and that push will return True.
-  if (next)
   {
+    // Tasks are queued behind us: a task that is queued with a priority might have added this mutex to our list.
+    std::lock_guard<std::mutex> lock(held_list_mutex(task));
+    if (m_held_by.load(std::memory_order_relaxed) == task)
+      remove_from_held(task);
+    // Another task is appending itself to the queue. If it didn't link its node to ours yet
+    // then leave it to that task to take ownership (and free our node) when it does.
+    if (!next && !(next = owner->m_next.exchange(&s_released, std::memory_order_acq_rel)))
+      return;
+    // Pass ownership to the next task. This must be sequentially consistent with the loads in boost_owner.
     Dout(dc::notice, "The mutex is now held by " << next->m_task << " [" << task << "]");
+    m_owner.store(next, std::memory_order_seq_cst);
+  }
+
+  // Free our node.
+  release_node(owner);
+
+  // Until next is woken up, the tasks queued behind it can't be granted the mutex: their nodes stay valid.
+  recalculate_waiter_priority(next);
+  add_held_by_owner(next);
+  // If next is already waiting in a thread pool queue, let it inherit the priority of the tasks behind it.
+  if (m_waiter_priority.load(std::memory_order_relaxed) < next->m_priority)
+    next->m_task->boost_priority();
+
+  // Wake up the next owner.
+  if (AI_UNLIKELY(m_profile))
+    m_profile->acquired_after_wait(next->m_task->task_name(), next->m_enqueued, now);
+  if (next->m_group)
+    next->m_group->granted();   // Lock the remaining mutexes of the group; the task is signaled once it holds all of them.
+  else if (m_handoff)
+    next->m_task->signal_handoff(next->m_condition);
+  else
     next->m_task->signal(next->m_condition);
+}
+
+void AIStatefulTaskMutex::add_to_held(AIStatefulTask* task)
+{
+  // Push this mutex on the front of the list of mutexes held by the task.
+  m_next_held = task->mHeldMutexes.load(std::memory_order_relaxed);
+  task->mHeldMutexes.store(this, std::memory_order_relaxed);
+  m_held_by.store(task, std::memory_order_relaxed);
+}
+
+void AIStatefulTaskMutex::remove_from_held(AIStatefulTask* task)
+{
+  m_held_by.store(nullptr, std::memory_order_relaxed);
+  AIStatefulTaskMutex* mutex = task->mHeldMutexes.load(std::memory_order_relaxed);
+  if (mutex == this)
+  {
+    task->mHeldMutexes.store(m_next_held, std::memory_order_relaxed);
+    return;
+  }
+  // This mutex must be in the list of its owner.
+  while (mutex->m_next_held != this)
+  {
+    mutex = mutex->m_next_held;
+    ASSERT(mutex);
   }
+  mutex->m_next_held = m_next_held;
+}
+
+void AIStatefulTaskMutex::add_held_by_owner(Node* node)
+{
+  // This must be sequentially consistent with the store to m_owner by our caller and the loads in boost_owner:
+  // a task that raised the waiter priority after we look either sees node as owner, or we see its priority here.
+  if (m_waiter_priority.load(std::memory_order_seq_cst) == no_waiter_priority)
+    return;
+  AIStatefulTask* task = node->m_task;
+  std::lock_guard<std::mutex> lock(held_list_mutex(task));
+  // The task of node can't unlock the mutex concurrently: it wasn't woken up yet, or it is the task that calls this.
+  // If nobody is queued behind it anymore then its unlock could take the fast path, which doesn't remove the mutex from the list.
+  if (m_held_by.load(std::memory_order_relaxed) == task || m_tail.load(std::memory_order_acquire) == node)
+    return;
+  add_to_held(task);
+}
+
+//static
+size_t AIStatefulTaskMutex::held_waiter_priority(AIStatefulTask const* task)
+{
+  size_t priority = no_waiter_priority;
+  // The lock prevents the mutexes from being removed from the list (and destroyed) while we read them.
+  std::lock_guard<std::mutex> lock(held_list_mutex(task));
+  for (AIStatefulTaskMutex const* mutex = task->mHeldMutexes.load(std::memory_order_relaxed); mutex; mutex = mutex->m_next_held)
+    priority = std::min(priority, mutex->m_waiter_priority.load(std::memory_order_relaxed));
+  return priority;
+}
+
+bool AIStatefulTaskMutex::raise_waiter_priority(size_t priority)
+{
+  // This must be sequentially consistent with the store in recalculate_waiter_priority.
+  size_t waiter_priority = m_waiter_priority.load(std::memory_order_seq_cst);
+  while (priority < waiter_priority)
+    if (m_waiter_priority.compare_exchange_weak(waiter_priority, priority, std::memory_order_seq_cst))
+      return true;
+  return false;
+}
+
+void AIStatefulTaskMutex::recalculate_waiter_priority(Node* node)
+{
+  // Called by the (next) owner of the mutex, or by the owner that is passing it to node: the nodes behind node stay valid.
+  Node* last = node;
+  size_t priority = no_waiter_priority;
+  for (Node* next; (next = last->m_next.load(std::memory_order_seq_cst)); last = next)
+    priority = std::min(priority, next->m_priority);
+  m_waiter_priority.store(priority, std::memory_order_seq_cst);
+  // A task that linked its node behind last after we looked raises the priority itself, unless it already did that
+  // before the above store; but in that case we see its node now.
+  for (Node* next; (next = last->m_next.load(std::memory_order_seq_cst)); last = next)
+    raise_waiter_priority(next->m_priority);
+}
+
+void AIStatefulTaskMutex::boost_owner(Node const* node)
+{
+  boost::intrusive_ptr<AIStatefulTask> owner_task;
+  for (;;)
+  {
+    // This must be sequentially consistent with the store to m_owner in unlock (see add_held_by_owner).
+    Node* owner = m_owner.load(std::memory_order_seq_cst);
+    // If we were granted the mutex in the meantime, or it is being passed on right now, then there is nothing to do:
+    // the thread that passes it on adds the mutex to the list of the next owner (see add_held_by_owner).
+    if (!owner || owner == node)
+      return;
+    // The node of the owner might be freed in the meantime, but reading m_task is still not UB (see debug_get_owner).
+    AIStatefulTask* task = owner->m_task;
+    std::lock_guard<std::mutex> lock(held_list_mutex(task));
+    // Since we are queued behind the owner, it can't unlock the mutex without taking this lock (see unlock).
+    // If it did so before we took it, then try again with the new owner.
+    if (m_owner.load(std::memory_order_relaxed) != owner || owner->m_task != task)
+      continue;
+    if (m_held_by.load(std::memory_order_relaxed) != task)
+      add_to_held(task);
+    // The owner can't be destroyed while it holds the mutex.
+    owner_task = task;
+    break;
+  }
+  // Thread confined tasks don't run in the thread pool.
+  if (!owner_task->is_thread_confined())
+    owner_task->boost_priority();
 }
 
 //static
 utils::NodeMemoryResource AIStatefulTaskMutex::s_node_memory_resource;
+
+//static
+AIStatefulTaskMutex::Node AIStatefulTaskMutex::s_released{nullptr, 0};
+
+//static
+std::array<std::mutex, 64> AIStatefulTaskMutex::s_held_list_mutexes;
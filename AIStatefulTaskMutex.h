@@ -30,22 +30,36 @@
 
 #include "threadsafe/aithreadsafe.h"
 #include "utils/NodeMemoryResource.h"
-#include "utils/threading/MpscQueue.h"
 #include "utils/FuzzyBool.h"
-#include "utils/cpu_relax.h"
+#include "MutexProfile.h"
 #include "debug.h"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 
 class AIStatefulTask;
+namespace statefultask {
+class MutexGroupBase;
+} // namespace statefultask
 
 // Node in a singly linked list of tasks that are waiting for this mutex.
-struct AIStatefulTaskMutexNode : public utils::threading::MpscNode
+struct AIStatefulTaskMutexNode
 {
   using condition_type = uint32_t;      // Must be the same as AIStatefulTask::condition_type
+  static constexpr size_t no_priority = ~size_t{0};     // The priority of tasks that don't run in the thread pool.
 
+  std::atomic<AIStatefulTaskMutexNode*> m_next;         // The next task in the queue, or nullptr.
   AIStatefulTask* m_task;
   condition_type const m_condition;
+  statefultask::MutexGroupBase* const m_group;          // The LockAll that m_task is waiting on, or nullptr.
+  size_t const m_priority;                              // The thread pool queue index of m_task when it locked the mutex, or no_priority.
+  statefultask::MutexProfile::clock_type::time_point m_enqueued;        // The time at which the node was queued (only set when profiling).
 
-  AIStatefulTaskMutexNode(AIStatefulTask* task, condition_type condition) : m_task(task), m_condition(condition) { }
+  AIStatefulTaskMutexNode(AIStatefulTask* task, condition_type condition, statefultask::MutexGroupBase* group = nullptr, size_t priority = no_priority) :
+    m_next(nullptr), m_task(task), m_condition(condition), m_group(group), m_priority(priority) { }
 };
 
 /**
@@ -81,126 +95,47 @@ struct AIStatefulTaskMutexNode : public utils::threading::MpscNode
  *     lock.unlock();   // Optional
  *     ... code that does not require the lock...
  *   }
+ *
+ * The tasks that are waiting for the mutex are kept in a FIFO queue (a MCS lock
+ * where the queue nodes are allocated from s_node_memory_resource). Locking
+ * a mutex that isn't locked doesn't allocate a node: it uses a node that is
+ * part of the mutex and costs a single CAS.
+ *
+ * A mutex that is constructed in hand-off mode wakes up the next owner with
+ * AIStatefulTask::signal_handoff instead of AIStatefulTask::signal: if that task runs in the
+ * same engine (or thread pool queue) as the task that unlocks the mutex, then it is continued
+ * by the same thread as soon as the unlocking task returns from multiplex_impl, instead
+ * of going through the queue of the engine (or thread pool). This is useful for short
+ * critical areas that are used by tasks that run in the same engine.
+ *
+ * The mutex implements priority inheritance for tasks that run in the thread pool:
+ * it records the highest priority (lowest AIQueueHandle) of the tasks that queued
+ * themselves, and while the owner holds the mutex it is added to that queue
+ * (if that has a higher priority than its own) whenever it is added to the thread pool.
+ * The recorded priority is reset when the mutex becomes unlocked without waiting tasks
+ * and recalculated from the tasks that are still waiting when it is passed to the next owner.
+ * The priority of a task is read by the thread that runs it, when it calls lock
+ * (or statefultask::LockAll::lock), and stored in its node; the thread that hands
+ * the mutex to a task only ever looks at the stored value.
+ * If the owner is already waiting in a thread pool queue with a lower priority when a task
+ * with a higher priority queues itself, then it is moved to the queue with the higher priority.
+ *
+ * The owner finds the priority that it inherits in the list of mutexes that it holds
+ * (AIStatefulTask::mHeldMutexes). A mutex is only added to that list when a task with a
+ * priority queues itself behind the owner (or when the mutex is passed to a task that has
+ * such tasks queued behind it), and then only removed by the unlock that can't take the fast path anyway.
+ * Hence locking and unlocking a mutex that nobody waits for still costs a single CAS each,
+ * without taking any lock. A task that queues itself in the short window between taking
+ * the unlocked mutex and the store to m_owner that follows it, doesn't find the owner: its priority
+ * is then only inherited by the tasks that get the mutex after that owner.
+ *
+ * Call enable_profiling to collect contention statistics (see statefultask::MutexProfile).
  */
 class AIStatefulTaskMutex
 {
   using condition_type = uint32_t;      // Must be the same as AIStatefulTask::condition_type
   using Node = AIStatefulTaskMutexNode;
 
- private:
-  class Queue : public utils::threading::MpscQueue
-  {
-    using MpscNode = utils::threading::MpscNode;
-    std::mutex m_abort_mutex;
-
-   public:
-    utils::FuzzyBool push(MpscNode* node)
-    {
-      node->m_next.store(nullptr, std::memory_order_relaxed);
-      MpscNode* prev = m_head.exchange(node, std::memory_order_relaxed);
-      // The only way node is guaranteed the next node that will be popped is when
-      // we just pushed to an empty list. In that case the situation right now is:
-      //
-      //   m_tail --> m_stub ==> nullptr, node
-      //                ^
-      //                |
-      //              prev
-      //
-      // This is a stable situation: calls to push by other threads just append
-      // on the right (change m_head), and calls to pop shouldn't happen (we
-      // are the owner of the lock; but even if it would happened, then pop will
-      // return nullptr and do nothing).
-      //
-      // If prev is not pointing to m_stub, then the situation is instead:
-      //
-      //   m_tail --> node1 ==> nullptr, node
-      //                ^
-      //                |
-      //              prev
-      //
-      // Possibly with more nodes (including m_stub) on the left, possibly incompletely
-      // linked, that can all be removed by calls to pop until we get this situation.
-      // That is also a stable situation as a call to pop in this case will return nullptr,
-      // because m_head is guaranteed unequal to m_tail.
-      //
-      // So in that case we are certain that at least one more pop() will finish
-      // before our node becomes the front node and we can return WasFalse.
-      //
-      // Assuming that prev does point to m_stub but we are not (yet) the next node
-      // that would be popped, for example, the situation is:
-      //
-      //   m_tail --> node1 ==> m_stub ==> nullptr, node
-      //                           ^
-      //                           |
-      //                         prev
-      //
-      // then pop will return node1 and set m_tail to point to m_stub to get
-      // the first situation. If we see that m_tail points to a node that is not
-      // m_stub, then the pop for that node did not finish yet and we can return
-      // WasFalse. If we see that m_tail points to m_stub then the call to pop
-      // for the previous node might have only JUST finished. However, in that
-      // case we can return True (resulting in no call to wait) because a
-      // subsequent signal will simply be ignored [or cause this task to continue
-      // running if somehow it tried to get the lock again (later) and fail to
-      // get it (causing a call to wait then); however that is not possible: we
-      // ARE at the front of the queue and that can not change no matter what
-      // other threads do].
-      //
-      bool is_front = prev == &m_stub && m_tail.load(std::memory_order_acquire) == &m_stub;
-
-      // Here m_head points to the new node, which either points to null
-      // or already points to the NEXT node that was pushed AND completed, etc.
-      // Now fix the next pointer of the node that m_head was pointing at.
-      prev->m_next.store(node, std::memory_order_release);
-
-      return is_front ? fuzzy::True : fuzzy::WasFalse;
-    }
-
-    // This function may only be called by the consumer!
-    //
-    // Returns the node that will be returned by the next call to pop.
-    //
-    // If nullptr is returned then the push, of the next non-null node that will be returned by
-    // pop, didn't complete yet (or wasn't even called yet).
-    //
-    // If &m_stub is returned then the push, of the next non-null node that will be returned by
-    // pop wasn't called yet and the list is empty.
-    MpscNode const* peek() const
-    {
-      // If m_tail is not pointing to m_stub then it points to the node that will be
-      // returned by a call to pop.
-      //
-      // If m_head is not pointing to m_stub (and m_tail is) then m_stub->m_next is the
-      // next node that will be returned by a call to pop. If this m_next value is still
-      // nullptr then an on going push (that changed the value of m_head away from
-      // m_stub) didn't complete yet. In that case we wait until this m_next pointer is
-      // updated.
-      //
-      // If m_head points to m_stub (and m_tail too) then the queue is empty;
-      // m_stub.m_next is guaranteed to be null too in that case. We just return
-      // nullptr then.
-      MpscNode const* tail = m_tail.load(std::memory_order_relaxed);
-      if (tail != &m_stub)
-        return tail;
-      MpscNode const* head = m_head.load(std::memory_order_relaxed);
-      if (head == &m_stub)
-          return nullptr;
-      // Wait for the current push to complete.
-      MpscNode const* next;
-      while (!(next = m_stub.m_next.load(std::memory_order_acquire)))
-        cpu_relax();
-      return next;
-    }
-
-    // This function is only called by the task that owns node; in other words,
-    // node is the queue and will not be popped for the duration of this call.
-    utils::FuzzyBool is_front(MpscNode const* node) const
-    {
-      MpscNode const* tail = m_tail.load(std::memory_order_relaxed);
-      return (tail == node || tail == &m_stub && m_stub.m_next.load(std::memory_order_acquire) == node) ? fuzzy::True : fuzzy::WasFalse;
-    }
-  };
-
  public:
   /// Returns the size of the nodes that will be allocated from s_node_memory_resource.
   static constexpr size_t node_size() { return sizeof(Node); }
@@ -209,25 +144,60 @@ class AIStatefulTaskMutex
   static utils::NodeMemoryResource s_node_memory_resource;      ///< Memory resource to allocate Node's from.
 
  private:
-  Queue m_queue;
+  // Stored in the m_next of the node of the owner by unlock() when it sees that another task
+  // is appending itself to the queue, but didn't link its node yet. That task then takes
+  // over the ownership of the mutex by itself; nobody ever waits for another thread.
+  static Node s_released;
+
+  std::atomic<Node*> m_tail;            // The last node in the queue, or nullptr when the mutex isn't locked.
+  std::atomic<Node*> m_owner;           // The node of the task that owns the mutex. Only written by the owner (or for the next owner by the owner that unlocks).
+  Node m_fast_node;                     // The node used by try_lock.
+  bool const m_handoff;                 // Set if the next owner must be woken up with signal_handoff.
+
+  // Priority inheritance.
+  static constexpr size_t no_waiter_priority = Node::no_priority;
+  std::atomic<size_t> m_waiter_priority;                // The lowest queue index (highest priority) of the tasks that queued themselves, or no_waiter_priority.
+  // The list of mutexes held by a task (AIStatefulTask::mHeldMutexes) is protected by held_list_mutex(task).
+  // While that lock is held, and the mutex is owned by that task with tasks queued behind it, m_owner doesn't change.
+  AIStatefulTaskMutex* m_next_held;                     // The next mutex in the list of mutexes held by the owner.
+  std::atomic<AIStatefulTask*> m_held_by;               // The task whose list this mutex is in (always the owner), or nullptr. Only changed while holding held_list_mutex(m_held_by).
+  static std::array<std::mutex, 64> s_held_list_mutexes;
+
+  std::unique_ptr<statefultask::MutexProfile> m_profile;        // Contention statistics, or nullptr when profiling is disabled.
 
  public:
-  /// Construct an unlocked AIStatefulTaskMutex.
-  AIStatefulTaskMutex() { }
-  // Immediately after construction, nobody owns the lock:
-  //
-  // m_head --> m_stub
+  /// Construct an unlocked AIStatefulTaskMutex. Pass true to construct it in hand-off mode.
+  AIStatefulTaskMutex(bool handoff = false) :
+    m_tail(nullptr), m_owner(nullptr), m_fast_node(nullptr, 0), m_handoff(handoff), m_waiter_priority(no_waiter_priority), m_next_held(nullptr), m_held_by(nullptr) { }
+
+  /// Try to obtain ownership for task without waiting and without allocating memory.
+  ///
+  /// @returns A handle pointer upon success and nullptr upon failure to obtain ownership.
+  ///
+  /// Upon failure the task is NOT queued and will not be signaled.
+  inline Node const* try_lock(AIStatefulTask* task);
 
-  /// Try to obtain ownership for owner (recursive locking allowed).
+  /// Try to obtain ownership for task.
   ///
   /// @returns A handle pointer upon success and nullptr upon failure to obtain ownership.
   ///
+  /// Upon failure the task is queued and will be signaled with condition once it obtained ownership.
   /// The returned handle must be passed to is_self_locked.
-  inline Node const* lock(AIStatefulTask* task, condition_type condition);
+  ///
+  /// Recursive locking is not supported (older versions documented it as allowed): a task
+  /// that already owns the mutex would queue itself behind itself and never be woken up.
+  /// Debug builds assert on this.
+  Node const* lock(AIStatefulTask* task, condition_type condition) { return lock(task, condition, nullptr, task_priority(task)); }
 
   /// Undo one (succcessful) call to lock.
   void unlock();
 
+  /// Start collecting contention statistics under the name \a name. Must be called before the mutex is used.
+  void enable_profiling(std::string name) { m_profile = std::make_unique<statefultask::MutexProfile>(std::move(name)); }
+
+  /// Returns the collected contention statistics, or nullptr if profiling wasn't enabled.
+  statefultask::MutexProfile const* profile() const { return m_profile.get(); }
+
   Node const* lock_blocking(AIStatefulTask* task)
   {
     Node const* node = lock(task, 0);
@@ -239,25 +209,63 @@ class AIStatefulTaskMutex
   }
 
 #if CW_DEBUG
-  // This is obviously a racy condition, unless called by the only consumer thread;
-  // which would be the thread running the task that currently has the lock, so if
-  // we know that that is the case then we don't need to call this function :p.
+  // This is obviously a racy condition, unless called by the thread running the
+  // task that currently has the lock, so if we know that that is the case then
+  // we don't need to call this function :p.
   //
   // Most notably, theoretically a task could be returned that is deleted by the time
   // you use it. So, don't use the result. It is intended only for debug output
   // (printing the returned pointer).
   AIStatefulTask* debug_get_owner() const
   {
-    AIStatefulTaskMutexNode const* next = static_cast<AIStatefulTaskMutexNode const*>(m_queue.peek());
-    // next might get deallocated right here, but even if that is the case then this still
+    Node const* owner = m_owner.load(std::memory_order_relaxed);
+    // owner might get deallocated right here, but even if that is the case then this still
     // isn't UB since it is allocated from a utils::SimpleSegregatedStorage which never
-    // *actually* frees memory. At most next->m_task is a non-sensical value, although the
+    // *actually* frees memory. At most owner->m_task is a non-sensical value, although the
     // chance for that is extremely small.
-    return next ? next->m_task : nullptr;
+    return owner ? owner->m_task : nullptr;
   }
 #endif
 
  private:
+  friend class statefultask::MutexGroupBase;
+  // If group is non-null then, upon failure, group->granted() is called instead of signaling the task.
+  // Priority must be task_priority(task), read by the thread that runs task.
+  inline Node const* lock(AIStatefulTask* task, condition_type condition, statefultask::MutexGroupBase* group, size_t priority);
+
+  // Return the priority of task: the index of the thread pool queue that it runs in, or no_waiter_priority.
+  // May only be called by the thread that runs task (the handlers of a task are not atomic).
+  static inline size_t task_priority(AIStatefulTask const* task);
+
+  // Add this mutex to the list of mutexes held by task. The caller must hold held_list_mutex(task).
+  void add_to_held(AIStatefulTask* task);
+  // Remove this mutex from the list of mutexes held by task. The caller must hold held_list_mutex(task).
+  void remove_from_held(AIStatefulTask* task);
+  // Called after node became the owner: add this mutex to the list of its task if tasks with a priority are queued behind it.
+  void add_held_by_owner(Node* node);
+  // Return the mutex that protects the list of mutexes held by task.
+  static std::mutex& held_list_mutex(AIStatefulTask const* task)
+  {
+    return s_held_list_mutexes[(reinterpret_cast<uintptr_t>(task) / alignof(std::max_align_t)) % s_held_list_mutexes.size()];
+  }
+  // Return the highest priority (lowest queue index) of the tasks waiting for one of the mutexes held by task.
+  static size_t held_waiter_priority(AIStatefulTask const* task);
+  // Record priority, that of a task that is queued waiting for this mutex. Returns true if that raised the waiter priority.
+  bool raise_waiter_priority(size_t priority);
+  // Recalculate the waiter priority from the tasks that are queued behind node, the (next) owner.
+  void recalculate_waiter_priority(Node* node);
+  // Called by the task of node, that is queued: add this mutex to the list of the owner and move that to a higher priority thread pool queue, if needed.
+  void boost_owner(Node const* node);
+
+  // Return node to where it came from, after it was removed from the queue.
+  void release_node(Node* node)
+  {
+    if (node == &m_fast_node)
+      node->m_next.store(nullptr, std::memory_order_relaxed);
+    else
+      s_node_memory_resource.deallocate(node);
+  }
+
   friend class AIStatefulTask;
   // Is this object currently owned (locked) by us?
   // May only be called from some multiplex_impl passing its own AIStatefulTask pointer,
@@ -277,9 +285,14 @@ class AIStatefulTaskMutex
   //     ...
   //     if (is_self_locked(the_mutex, m_handle))
   //      ...
-  utils::FuzzyBool is_self_locked(Node const* handle) const
+  //
+  // Comparing the handle alone is not enough: after we unlocked, m_fast_node (or a recycled
+  // node) can be the handle of another task that owns the mutex now.
+  utils::FuzzyBool is_self_locked(AIStatefulTask const* task, Node const* handle) const
   {
-    return m_queue.is_front(handle);
+    Node const* owner = m_owner.load(std::memory_order_relaxed);
+    // If owner is not our node then it might be deallocated, but reading m_task is still not UB (see debug_get_owner).
+    return owner == handle && owner->m_task == task ? fuzzy::True : fuzzy::WasFalse;
   }
 };
 
@@ -316,23 +329,81 @@ class AdoptLock
 #ifndef AISTATEFULTASKMUTEX_H_definitions
 #define AISTATEFULTASKMUTEX_H_definitions
 
-AIStatefulTaskMutex::Node const* AIStatefulTaskMutex::lock(AIStatefulTask* task, condition_type condition)
+AIStatefulTaskMutex::Node const* AIStatefulTaskMutex::try_lock(AIStatefulTask* task)
+{
+  Node* expected = nullptr;
+  if (!m_tail.compare_exchange_strong(expected, &m_fast_node, std::memory_order_acquire, std::memory_order_relaxed))
+    return nullptr;
+  // The mutex wasn't locked: m_fast_node isn't in use by anyone else.
+  m_fast_node.m_task = task;
+  m_owner.store(&m_fast_node, std::memory_order_relaxed);
+  if (AI_UNLIKELY(m_profile))
+    m_profile->acquired(task->task_name(), statefultask::MutexProfile::clock_type::now());
+  return &m_fast_node;
+}
+
+size_t AIStatefulTaskMutex::task_priority(AIStatefulTask const* task)
+{
+  // Only tasks that run in a thread pool queue have a priority.
+  AIStatefulTask::Handler const handler = task->mTargetHandler ? task->mTargetHandler : task->mDefaultHandler;
+  return handler.is_thread_pool() ? handler.get_queue_handle().get_value() : no_waiter_priority;
+}
+
+AIStatefulTaskMutex::Node const* AIStatefulTaskMutex::lock(AIStatefulTask* task, condition_type condition, statefultask::MutexGroupBase* group, size_t priority)
 {
   DoutEntering(dc::notice, "AIStatefulTaskMutex::lock(" << task << ", " << task->print_conditions(condition) << ") [mutex:" << this << "]");
 
-  Node* new_node = new (s_node_memory_resource.allocate(sizeof(Node))) Node(task, condition);
-  Dout(dc::notice, "Create new node at " << new_node << " [" << task << "]");
+  // Fast path: the mutex isn't locked.
+  if (Node const* handle = try_lock(task))
+  {
+    Dout(dc::notice, "Mutex acquired [" << task << "]");
+    return handle;
+  }
+
+#if CW_DEBUG
+  // Recursive locking would deadlock.
+  Node const* owner = m_owner.load(std::memory_order_relaxed);
+  ASSERT(!owner || owner->m_task != task);
+#endif
 
-  utils::FuzzyBool have_lock = m_queue.push(new_node);
+  Node* new_node = new (s_node_memory_resource.allocate(sizeof(Node))) Node(task, condition, group, priority);
+  Dout(dc::notice, "Create new node at " << new_node << " [" << task << "]");
+  // Record the time before the node becomes visible to unlock(), which might grant it the mutex right away.
+  if (AI_UNLIKELY(m_profile))
+  {
+    new_node->m_enqueued = statefultask::MutexProfile::clock_type::now();
+    m_profile->queued(task->task_name());
+  }
 
-  // If the next return from pop() will return new_node, then have_lock MUST be True.
-  // If the next return from pop() will return another node then have_lock MUST be WasFalse.
-  if (have_lock.is_true())
+  // Append new_node to the queue.
+  Node* prev = m_tail.exchange(new_node, std::memory_order_acq_rel);
+  if (!prev)
+  {
+    // The mutex was unlocked in the meantime.
+    Dout(dc::notice, "Mutex acquired [" << task << "]");
+    m_owner.store(new_node, std::memory_order_relaxed);
+    if (AI_UNLIKELY(m_profile))
+      m_profile->acquired_after_wait(task->task_name(), new_node->m_enqueued, statefultask::MutexProfile::clock_type::now());
+    return new_node;
+  }
+  // Link prev to us. This must be sequentially consistent with the loads in recalculate_waiter_priority.
+  if (prev->m_next.exchange(new_node, std::memory_order_seq_cst) == &s_released)
   {
+    // The owner of prev unlocked the mutex before we could link our node to it, and left it to us to take over.
+    release_node(prev);
     Dout(dc::notice, "Mutex acquired [" << task << "]");
+    // The tasks that queued themselves behind us before the waiter priority was reset have to be taken into account again.
+    recalculate_waiter_priority(new_node);
+    m_owner.store(new_node, std::memory_order_seq_cst);
+    add_held_by_owner(new_node);
+    if (AI_UNLIKELY(m_profile))
+      m_profile->acquired_after_wait(task->task_name(), new_node->m_enqueued, statefultask::MutexProfile::clock_type::now());
     return new_node;
   }
   Dout(dc::notice, "Mutex already locked [" << task << "]");
+  // Don't dereference new_node anymore: it might already have been granted the mutex (and freed) by another thread.
+  if (raise_waiter_priority(priority))
+    boost_owner(new_node);
 
   // Obtaining the lock failed. Halt the task
   return nullptr;     // The caller must call task->wait(condition).
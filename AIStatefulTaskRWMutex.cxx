@@ -0,0 +1,113 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Implementation of AIStatefulTaskRWMutex.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "AIStatefulTaskRWMutex.h"
+#include "AIStatefulTask.h"
+
+bool AIStatefulTaskRWMutex::lock_slow(AIStatefulTask* task, condition_type condition, bool writer)
+{
+  DoutEntering(dc::notice, "AIStatefulTaskRWMutex::lock_slow(" << task << ", " << task->print_conditions(condition) << ", " << writer << ") [mutex:" << this << "]");
+  queue_type::wat queue_w(m_queue);
+  word_type word = m_word.load(std::memory_order_relaxed);
+  for (;;)
+  {
+    // While m_queue is locked, the waiters_bit is set iff tasks are waiting; do not overtake them.
+    bool const available = writer ? word == 0 : !(word & (writer_bit | waiters_bit));
+    if (available)
+    {
+      if (m_word.compare_exchange_weak(word, writer ? writer_bit : word + 1, std::memory_order_acquire, std::memory_order_relaxed))
+      {
+        Dout(dc::notice, (writer ? "Write" : "Read") << " lock acquired [" << task << "]");
+        return true;
+      }
+      continue;
+    }
+    // Set the waiters_bit, so that the unlock that releases the lock completely takes the slow path and grants it to us.
+    // This fails when the lock was released in the meantime, in which case we try again.
+    if ((word & waiters_bit) || m_word.compare_exchange_weak(word, word | waiters_bit, std::memory_order_relaxed, std::memory_order_relaxed))
+      break;
+  }
+  Node* new_node = new (AIStatefulTaskMutex::s_node_memory_resource.allocate(sizeof(Node))) Node(task, condition, writer);
+  if (queue_w->m_head)
+    queue_w->m_tail->m_next = new_node;
+  else
+    queue_w->m_head = new_node;
+  queue_w->m_tail = new_node;
+  Dout(dc::notice, "Mutex is locked or has waiting tasks [" << task << "]");
+  return false;         // The caller must call task->wait(condition).
+}
+
+void AIStatefulTaskRWMutex::unlock_slow()
+{
+  DoutEntering(dc::notice, "AIStatefulTaskRWMutex::unlock_slow() [mutex:" << this << "]");
+  Node* granted;
+  {
+    queue_type::wat queue_w(m_queue);
+    // The lock was released completely while the waiters_bit was set. Since the fast paths fail
+    // and lock_slow needs the lock on m_queue, nobody else can change m_word until we're done.
+    ASSERT(m_word.load(std::memory_order_relaxed) == waiters_bit && queue_w->m_head);
+    granted = queue_w->m_head;
+    Node* last = granted;
+    word_type word;
+    if (granted->m_writer)
+      word = writer_bit;
+    else
+    {
+      // Grant all readers at the front of the queue in one go.
+      word = 1;
+      while (last->m_next && !last->m_next->m_writer)
+      {
+        last = last->m_next;
+        ++word;
+      }
+    }
+    // Remove the granted nodes from the queue, and reset the waiters_bit when the queue became empty.
+    queue_w->m_head = last->m_next;
+    last->m_next = nullptr;
+    if (queue_w->m_head)
+      word |= waiters_bit;
+    m_word.store(word, std::memory_order_relaxed);
+  }
+  signal_granted(granted);
+}
+
+//static
+void AIStatefulTaskRWMutex::signal_granted(Node* list)
+{
+  // Called without holding the lock on m_state, because signal() could cause the task to run immediately.
+  while (list)
+  {
+    Node* node = list;
+    list = node->m_next;
+    AIStatefulTask* task = node->m_task;
+    condition_type condition = node->m_condition;
+    Dout(dc::notice, "The mutex is now " << (node->m_writer ? "write" : "read") << " locked by " << task);
+    AIStatefulTaskMutex::s_node_memory_resource.deallocate(node);
+    task->signal(condition);
+  }
+}
@@ -0,0 +1,246 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Read/write mutex for stateful tasks. Declaration of class AIStatefulTaskRWMutex.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "AIStatefulTaskMutex.h"
+#include "threadsafe/aithreadsafe.h"
+#include "debug.h"
+#include <atomic>
+#include <mutex>
+
+class AIStatefulTask;
+
+/**
+ * A task read/write mutex.
+ *
+ * Like AIStatefulTaskMutex, but allows any number of tasks to hold a read lock at the same time.
+ *
+ * For example,
+ *
+ *   AIStatefulTaskRWMutex m;
+ *
+ * ...
+ *   case MyTask_wait_for_read_lock:
+ *     set_state(MyTask_read_locked);
+ *     if (!m.rdlock(this, 1))
+ *     {
+ *       wait(1);
+ *       break;
+ *     }
+ *     [[fallthrough]];
+ *   case MyTask_read_locked:
+ *   {
+ *     statefultask::AdoptReadLock lock(m);
+ *     read_cache();
+ *   }
+ *
+ * A task that fails to obtain the lock is queued and signaled with the
+ * passed condition once the lock was granted to it; it must then call wait(condition).
+ *
+ * The queue is strictly FIFO: a new reader does not get the lock while a writer
+ * is waiting, so writers are not starved. When the lock is released, all readers
+ * at the front of the queue (up to the next writer) are granted the lock in one batch.
+ *
+ * When no task is waiting, the lock and unlock functions are a single atomic
+ * operation on m_word, which holds the number of readers, a writer bit and a waiters bit.
+ * Otherwise the waiting tasks are queued in a list that is protected by a std::mutex,
+ * which is also held while the waiters_bit is set or reset and while the lock is granted
+ * to the tasks at the front of the queue (never while signaling a task). Once the
+ * waiters_bit is set the fast paths fail, so that new tasks do not overtake waiting ones.
+ *
+ * The queue nodes are allocated from AIStatefulTaskMutex::s_node_memory_resource,
+ * so AIStatefulTaskMutex::init must have been called (see DefaultMemoryPagePool).
+ */
+class AIStatefulTaskRWMutex
+{
+  using condition_type = uint32_t;      // Must be the same as AIStatefulTask::condition_type
+
+ private:
+  // Node in a singly linked list of tasks that are waiting for this mutex.
+  struct Node
+  {
+    Node* m_next;                       // The next task in the queue, or nullptr.
+    AIStatefulTask* m_task;
+    condition_type m_condition;
+    bool m_writer;                      // True if this task wants a write lock.
+
+    Node(AIStatefulTask* task, condition_type condition, bool writer) : m_next(nullptr), m_task(task), m_condition(condition), m_writer(writer) { }
+  };
+  static_assert(sizeof(Node) <= AIStatefulTaskMutex::node_size(), "Node must fit in the blocks of AIStatefulTaskMutex::s_node_memory_resource.");
+
+  struct queue_st
+  {
+    Node* m_head;                       // The first task that is waiting, or nullptr when no task is waiting.
+    Node* m_tail;                       // The last task that is waiting (only valid when m_head is non-null).
+
+    queue_st() : m_head(nullptr), m_tail(nullptr) { }
+  };
+  using queue_type = aithreadsafe::Wrapper<queue_st, aithreadsafe::policy::Primitive<std::mutex>>;
+
+ public:
+  using word_type = uint32_t;
+  static constexpr word_type writer_bit = 0x80000000;           ///< Set in m_word while a task holds the write lock.
+  static constexpr word_type waiters_bit = 0x40000000;          ///< Set in m_word while tasks are queued.
+  static constexpr word_type readers_mask = waiters_bit - 1;    ///< The bits of m_word that contain the number of readers.
+
+ private:
+  std::atomic<word_type> m_word;        // The number of readers, plus writer_bit while write locked, plus waiters_bit iff m_queue is not empty.
+  queue_type m_queue;                   // The waiting tasks. The waiters_bit is only changed while this is locked.
+
+ public:
+  /// Construct an unlocked AIStatefulTaskRWMutex.
+  AIStatefulTaskRWMutex() : m_word(0) { }
+
+  /// Try to obtain a read lock for task without waiting.
+  ///
+  /// @returns True upon success. Upon failure the task is NOT queued and will not be signaled.
+  bool try_rdlock(AIStatefulTask* task)
+  {
+    word_type word = m_word.load(std::memory_order_relaxed);
+    // Do not overtake tasks that are waiting (that would starve writers).
+    while (!(word & (writer_bit | waiters_bit)))
+    {
+      // Too many readers.
+      ASSERT((word & readers_mask) < readers_mask);
+      if (m_word.compare_exchange_weak(word, word + 1, std::memory_order_acquire, std::memory_order_relaxed))
+      {
+        Dout(dc::notice, "Read lock acquired [" << task << "] [mutex:" << this << "]");
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// Try to obtain the write lock for task without waiting.
+  ///
+  /// @returns True upon success. Upon failure the task is NOT queued and will not be signaled.
+  bool try_wrlock(AIStatefulTask* task)
+  {
+    word_type expected = 0;
+    if (!m_word.compare_exchange_strong(expected, writer_bit, std::memory_order_acquire, std::memory_order_relaxed))
+      return false;
+    Dout(dc::notice, "Write lock acquired [" << task << "] [mutex:" << this << "]");
+    return true;
+  }
+
+  /// Try to obtain a read lock for task.
+  ///
+  /// @returns True upon success; false if the task was queued and will be signaled with condition once it obtained the read lock.
+  bool rdlock(AIStatefulTask* task, condition_type condition)
+  {
+    return try_rdlock(task) || lock_slow(task, condition, false);
+  }
+
+  /// Try to obtain the write lock for task.
+  ///
+  /// @returns True upon success; false if the task was queued and will be signaled with condition once it obtained the write lock.
+  bool wrlock(AIStatefulTask* task, condition_type condition)
+  {
+    return try_wrlock(task) || lock_slow(task, condition, true);
+  }
+
+  /// Undo one (successful) call to rdlock or try_rdlock.
+  void rdunlock()
+  {
+    word_type const word = m_word.fetch_sub(1, std::memory_order_release);
+    // Only call rdunlock() after a successful rdlock().
+    ASSERT((word & readers_mask) > 0 && !(word & writer_bit));
+    // The last reader grants the lock to the waiting tasks.
+    if (AI_UNLIKELY(word == (waiters_bit | 1)))
+      unlock_slow();
+  }
+
+  /// Undo one (successful) call to wrlock or try_wrlock.
+  void wrunlock()
+  {
+    word_type word = writer_bit;
+    if (AI_LIKELY(m_word.compare_exchange_strong(word, 0, std::memory_order_release, std::memory_order_relaxed)))
+      return;
+    // Only call wrunlock() after a successful wrlock().
+    ASSERT(word == (writer_bit | waiters_bit));
+    unlock_slow();
+  }
+
+ private:
+  // Queue the task, unless the lock can be obtained after all.
+  bool lock_slow(AIStatefulTask* task, condition_type condition, bool writer);
+  // Grant the lock to the task(s) at the front of the queue, after the lock was released completely while tasks are waiting.
+  void unlock_slow();
+  // Signal the tasks in list and free their nodes.
+  static void signal_granted(Node* list);
+};
+
+namespace statefultask {
+
+// Convenience class to automatically read-unlock the mutex upon leaving the current scope.
+class AdoptReadLock
+{
+ private:
+  AIStatefulTaskRWMutex* m_mutex;
+
+ public:
+  AdoptReadLock(AIStatefulTaskRWMutex& mutex) : m_mutex(&mutex) { }
+  ~AdoptReadLock() { unlock(); }
+
+  void unlock()
+  {
+    if (m_mutex)
+      m_mutex->rdunlock();
+    m_mutex = nullptr;
+  }
+
+  void skip_unlock()
+  {
+    m_mutex = nullptr;
+  }
+};
+
+// Convenience class to automatically write-unlock the mutex upon leaving the current scope.
+class AdoptWriteLock
+{
+ private:
+  AIStatefulTaskRWMutex* m_mutex;
+
+ public:
+  AdoptWriteLock(AIStatefulTaskRWMutex& mutex) : m_mutex(&mutex) { }
+  ~AdoptWriteLock() { unlock(); }
+
+  void unlock()
+  {
+    if (m_mutex)
+      m_mutex->wrunlock();
+    m_mutex = nullptr;
+  }
+
+  void skip_unlock()
+  {
+    m_mutex = nullptr;
+  }
+};
+
+} // namespace statefultask
@@ -0,0 +1,110 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Implementation of AIStatefulTaskSemaphore.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "AIStatefulTaskSemaphore.h"
+#include "AIStatefulTask.h"
+
+bool AIStatefulTaskSemaphore::acquire_slow(AIStatefulTask* task, count_type permits, condition_type condition)
+{
+  DoutEntering(dc::notice, "AIStatefulTaskSemaphore::acquire_slow(" << task << ", " << permits << ", " << task->print_conditions(condition) << ") [semaphore:" << this << "]");
+  // Asking for more permits than can ever be available would wait forever.
+  ASSERT(permits <= count_mask);
+  queue_type::wat queue_w(m_queue);
+  count_type word = m_word.load(std::memory_order_relaxed);
+  for (;;)
+  {
+    // Do not overtake tasks that are waiting.
+    if (!queue_w->m_head && word >= permits)
+    {
+      if (m_word.compare_exchange_weak(word, word - permits, std::memory_order_acquire, std::memory_order_relaxed))
+      {
+        Dout(dc::notice, "Permits acquired [" << task << "]");
+        return true;
+      }
+      continue;
+    }
+    // Set the waiters_bit, so that release() will take the slow path and grant us the permits.
+    // This fails when release() added permits in the meantime, in which case we try again.
+    if (m_word.compare_exchange_weak(word, word | waiters_bit, std::memory_order_relaxed, std::memory_order_relaxed))
+      break;
+  }
+  Node* new_node = new (AIStatefulTaskMutex::s_node_memory_resource.allocate(sizeof(Node))) Node(task, condition, permits);
+  if (queue_w->m_head)
+    queue_w->m_tail->m_next = new_node;
+  else
+    queue_w->m_head = new_node;
+  queue_w->m_tail = new_node;
+  Dout(dc::notice, "Not enough permits available [" << task << "]");
+  return false;         // The caller must call task->wait(condition).
+}
+
+void AIStatefulTaskSemaphore::release_slow(count_type permits)
+{
+  DoutEntering(dc::notice, "AIStatefulTaskSemaphore::release_slow(" << permits << ") [semaphore:" << this << "]");
+  Node* granted = nullptr;
+  {
+    queue_type::wat queue_w(m_queue);
+    // While the waiters_bit is set, m_word is only changed while holding the lock on m_queue.
+    // If it was reset in the meantime then the queue is empty and we are done after adding the permits.
+    count_type const previous = m_word.fetch_add(permits, std::memory_order_relaxed);
+    // Releasing more permits than were acquired would overflow into the waiters_bit.
+    ASSERT((previous & count_mask) + permits <= count_mask);
+    count_type word = previous + permits;
+    count_type available = word & count_mask;
+    count_type taken = 0;
+    Node* last = nullptr;
+    // Grant permits to the tasks at the front of the queue, in order.
+    while (queue_w->m_head && queue_w->m_head->m_permits <= available)
+    {
+      last = queue_w->m_head;
+      available -= last->m_permits;
+      taken += last->m_permits;
+      if (!granted)
+        granted = last;
+      queue_w->m_head = last->m_next;
+    }
+    if (last)
+      last->m_next = nullptr;
+    // Reset the waiters_bit when the queue became empty.
+    if (!queue_w->m_head && (word & waiters_bit))
+      taken |= waiters_bit;
+    if (taken)
+      m_word.fetch_sub(taken, std::memory_order_acquire);
+  }
+  // Signal the granted tasks without holding the lock on m_queue, because signal() could cause the task to run immediately.
+  while (granted)
+  {
+    Node* node = granted;
+    granted = node->m_next;
+    AIStatefulTask* task = node->m_task;
+    condition_type condition = node->m_condition;
+    Dout(dc::notice, "Granted " << node->m_permits << " permits to " << task);
+    AIStatefulTaskMutex::s_node_memory_resource.deallocate(node);
+    task->signal(condition);
+  }
+}
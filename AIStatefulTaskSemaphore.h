@@ -0,0 +1,182 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Counting semaphore for stateful tasks. Declaration of class AIStatefulTaskSemaphore.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "AIStatefulTaskMutex.h"
+#include "threadsafe/aithreadsafe.h"
+#include "debug.h"
+#include <atomic>
+#include <mutex>
+
+class AIStatefulTask;
+
+/**
+ * A task counting semaphore.
+ *
+ * Limit the number of tasks that concurrently use some resource, without blocking a thread.
+ *
+ * For example,
+ *
+ *   // At most four expensive tasks may run at the same time.
+ *   AIStatefulTaskSemaphore s(4);
+ *
+ * ...
+ *   case MyTask_acquire:
+ *     set_state(MyTask_acquired);
+ *     if (!s.acquire(this, 1, 1))
+ *     {
+ *       wait(1);
+ *       break;
+ *     }
+ *     [[fallthrough]];
+ *   case MyTask_acquired:
+ *     do_expensive_work();
+ *     s.release(1);
+ *
+ * A task that can't obtain the requested number of permits is queued and signaled with
+ * the passed condition once the permits were granted to it; it must then call wait(condition).
+ *
+ * When no task is waiting, acquire and release are a single CAS on an atomic word.
+ * Otherwise the (strictly FIFO) queue of waiting tasks is used: a new task does not
+ * overtake waiting tasks, even if enough permits are available for it, so that tasks
+ * that need many permits are not starved.
+ *
+ * The queue nodes are allocated from AIStatefulTaskMutex::s_node_memory_resource,
+ * so AIStatefulTaskMutex::init must have been called (see DefaultMemoryPagePool).
+ */
+class AIStatefulTaskSemaphore
+{
+  using condition_type = uint32_t;      // Must be the same as AIStatefulTask::condition_type
+
+ public:
+  using count_type = uint32_t;
+  static constexpr count_type waiters_bit = 0x80000000;         ///< Set in m_word while tasks are queued.
+  static constexpr count_type count_mask = waiters_bit - 1;     ///< The bits of m_word that contain the number of available permits.
+
+ private:
+  // Node in a singly linked list of tasks that are waiting for permits.
+  struct Node
+  {
+    Node* m_next;                       // The next task in the queue, or nullptr.
+    AIStatefulTask* m_task;
+    condition_type m_condition;
+    count_type m_permits;               // The number of permits that this task wants.
+
+    Node(AIStatefulTask* task, condition_type condition, count_type permits) : m_next(nullptr), m_task(task), m_condition(condition), m_permits(permits) { }
+  };
+  static_assert(sizeof(Node) <= AIStatefulTaskMutex::node_size(), "Node must fit in the blocks of AIStatefulTaskMutex::s_node_memory_resource.");
+
+  struct queue_st
+  {
+    Node* m_head;                       // The first task that is waiting, or nullptr when no task is waiting.
+    Node* m_tail;                       // The last task that is waiting (only valid when m_head is non-null).
+
+    queue_st() : m_head(nullptr), m_tail(nullptr) { }
+  };
+  using queue_type = aithreadsafe::Wrapper<queue_st, aithreadsafe::policy::Primitive<std::mutex>>;
+
+  std::atomic<count_type> m_word;       // The number of available permits, plus waiters_bit iff m_queue is not empty.
+  queue_type m_queue;                   // The waiting tasks. The waiters_bit is only changed while this is locked.
+
+ public:
+  /// Construct a semaphore with \a permits available permits.
+  AIStatefulTaskSemaphore(count_type permits) : m_word(permits)
+  {
+    // Too many permits.
+    ASSERT(permits <= count_mask);
+  }
+
+  /// Try to obtain \a permits permits without queuing the task.
+  ///
+  /// @returns True upon success. Upon failure the task is NOT queued and will not be signaled.
+  bool try_acquire(count_type permits)
+  {
+    count_type word = m_word.load(std::memory_order_relaxed);
+    while (!(word & waiters_bit) && word >= permits)
+      if (m_word.compare_exchange_weak(word, word - permits, std::memory_order_acquire, std::memory_order_relaxed))
+        return true;
+    return false;
+  }
+
+  /// Try to obtain \a permits permits for task.
+  ///
+  /// @returns True upon success; false if the task was queued and will be signaled with condition once it obtained the permits.
+  bool acquire(AIStatefulTask* task, count_type permits, condition_type condition)
+  {
+    return try_acquire(permits) || acquire_slow(task, permits, condition);
+  }
+
+  /// Return \a permits permits to the semaphore.
+  void release(count_type permits)
+  {
+    count_type word = m_word.load(std::memory_order_relaxed);
+    while (!(word & waiters_bit))
+    {
+      // Releasing more permits than were acquired would overflow into the waiters_bit.
+      ASSERT((word & count_mask) + permits <= count_mask);
+      if (m_word.compare_exchange_weak(word, word + permits, std::memory_order_release, std::memory_order_relaxed))
+        return;
+    }
+    release_slow(permits);
+  }
+
+  /// Returns the number of available permits. This is racy and only intended for diagnostics.
+  count_type available() const { return m_word.load(std::memory_order_relaxed) & count_mask; }
+
+ private:
+  bool acquire_slow(AIStatefulTask* task, count_type permits, condition_type condition);
+  void release_slow(count_type permits);
+};
+
+namespace statefultask {
+
+// Convenience class to automatically release the acquired permits upon leaving the current scope.
+class AdoptPermits
+{
+ private:
+  AIStatefulTaskSemaphore* m_semaphore;
+  AIStatefulTaskSemaphore::count_type m_permits;
+
+ public:
+  AdoptPermits(AIStatefulTaskSemaphore& semaphore, AIStatefulTaskSemaphore::count_type permits) : m_semaphore(&semaphore), m_permits(permits) { }
+  ~AdoptPermits() { release(); }
+
+  void release()
+  {
+    if (m_semaphore)
+      m_semaphore->release(m_permits);
+    m_semaphore = nullptr;
+  }
+
+  void skip_release()
+  {
+    m_semaphore = nullptr;
+  }
+};
+
+} // namespace statefultask
@@ -0,0 +1,105 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Reusable rendezvous point for tasks. Declaration of class Barrier.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "Latch.h"
+
+namespace statefultask {
+
+// Barrier
+//
+// A reusable synchronization point for a fixed number of tasks:
+// each phase completes when all participants arrived.
+//
+// Usage:
+//
+//   statefultask::Barrier m_tick{number_of_tasks};
+//
+// Each participating task, at the end of every phase, does:
+//
+//   case EndOfTick:
+//     set_state(NextTick);
+//     if (!m_tick.arrive_and_wait(m_tick_waiter, this, 1))      // m_tick_waiter is a TaskWaiter member.
+//     {
+//       wait(1);
+//       break;
+//     }
+//     [[fallthrough]];
+//   case NextTick:
+//
+// Arriving is a push on an intrusive lock-free stack and an atomic decrement.
+// The last task to arrive resets the barrier for the next phase and signals
+// all other participants in one batch; it continues without waiting itself.
+//
+class Barrier
+{
+ private:
+  uint32_t const m_participants;
+  std::atomic<uint32_t> m_count;        // The number of tasks that still have to arrive in the current phase.
+  std::atomic<TaskWaiter*> m_waiters;   // Intrusive stack of the tasks that arrived in the current phase.
+
+ public:
+  explicit Barrier(uint32_t participants) : m_participants(participants), m_count(participants), m_waiters(nullptr)
+  {
+    // A barrier needs participants.
+    ASSERT(participants > 0);
+  }
+
+  ~Barrier()
+  {
+    // Destroying a barrier that tasks are still waiting on.
+    ASSERT(m_waiters == nullptr);
+  }
+
+  // Arrive at the barrier. Returns true if task was the last to arrive (the next phase started).
+  // Otherwise task will be signaled with condition once all participants arrived.
+  bool arrive_and_wait(TaskWaiter& waiter, AIStatefulTask* task, AIStatefulTask::condition_type condition)
+  {
+    waiter.m_task = task;
+    waiter.m_condition = condition;
+    // Register before decrementing the counter, so that the last task to arrive sees us.
+    TaskWaiter* head = m_waiters.load(std::memory_order_relaxed);
+    do
+      waiter.m_next = head;
+    while (!m_waiters.compare_exchange_weak(head, &waiter, std::memory_order_release, std::memory_order_relaxed));
+    uint32_t previous_count = m_count.fetch_sub(1, std::memory_order_acq_rel);
+    // More tasks arrived than there are participants.
+    ASSERT(previous_count > 0);
+    if (previous_count > 1)
+      return false;     // The caller must call task->wait(condition).
+    // We are the last to arrive. Start the next phase before signaling anyone:
+    // the other participants can only arrive again after they were signaled.
+    TaskWaiter* arrived = m_waiters.exchange(nullptr, std::memory_order_acquire);
+    m_count.store(m_participants, std::memory_order_release);
+    Dout(dc::notice, "Barrier " << this << " completed a phase.");
+    detail::signal_waiters(arrived, &waiter);
+    return true;
+  }
+};
+
+} // namespace statefultask
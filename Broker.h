@@ -2,11 +2,22 @@
 
 #include "AIStatefulTask.h"
 #include "BrokerKey.h"
+#include "BrokerMetrics.h"
+#include "DefaultMemoryPagePool.h"
 #include "threadsafe/AIReadWriteMutex.h"
 #include "utils/threading/MpscQueue.h"
 #include "utils/threading/Gate.h"
 #include <type_traits>
+#include <cstddef>
+#include <new>
+#include <array>
+#include <bit>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <deque>
 #include <tuple>
+#include <span>
 #ifdef CWDEBUG
 #include "utils/has_print_on.h"
 #endif
@@ -22,6 +33,19 @@ namespace task {
 using utils::has_print_on::operator<<;
 #endif
 
+// Broker<Task, Args...>
+//
+// If the first type of Args is statefultask::TypedBrokerKey<Key> then Key is used as key type,
+// otherwise the keys are derived from statefultask::BrokerKey. The (remaining) Args are the
+// types of the arguments passed to the constructor of the Task.
+//
+// The callbacks that are queued by run() and run_many() are moved into nodes that are allocated
+// from a memory resource; a callback of at most CallbackNode::storage_size (48) bytes is stored
+// in the node itself, so that queuing it doesn't call malloc. A larger callback (or one with
+// stricter alignment than std::max_align_t) is stored on the heap: capture a pointer to larger
+// state instead. Note that passing a std::function doesn't help: constructing it might already
+// allocate (with libstdc++ for any callable that isn't trivially copyable or is larger than 16 bytes).
+//
 template<TaskType Task, typename... Args>
 class Broker : public AIStatefulTask
 {
@@ -37,35 +61,105 @@ class Broker : public AIStatefulTask
  public:
   static constexpr state_type state_end = Broker_do_work + 1;      // The last state plus one.
 
+  using clock_type = std::chrono::steady_clock;
+
  private:
+  using key_traits = statefultask::BrokerKeyTraits<Args...>;
+  using map_key_type = typename key_traits::map_key_type;
+  using key_type = std::remove_cvref_t<decltype(*key_traits::key_ptr(std::declval<map_key_type const&>()))>;
+
+  // A queued callback, type-erased into the node.
   struct CallbackNode : utils::threading::MpscNode
   {
-    std::function<void(bool)> m_callback;
+    static constexpr size_t storage_size = 48;  // Large enough for a std::function or a handful of captures.
+
+    template<typename F>
+    static constexpr bool fits_in_node = sizeof(F) <= storage_size && alignof(F) <= alignof(std::max_align_t);
+
+    void (*m_invoke)(CallbackNode*, bool);      // Calls the stored callback.
+    void (*m_destroy)(CallbackNode*);           // Destructs the stored callback.
+    alignas(std::max_align_t) std::byte m_storage[storage_size];
+
+    template<typename F>
+    CallbackNode(F&& callback)
+    {
+      using callback_type = std::decay_t<F>;
+      if constexpr (fits_in_node<callback_type>)
+      {
+        new (m_storage) callback_type(std::forward<F>(callback));
+        m_invoke = [](CallbackNode* node, bool success){ (*node->template stored<callback_type>())(success); };
+        m_destroy = [](CallbackNode* node){ node->template stored<callback_type>()->~callback_type(); };
+      }
+      else
+      {
+        // Too large: store a pointer to a heap allocated copy.
+        new (m_storage) callback_type*(new callback_type(std::forward<F>(callback)));
+        m_invoke = [](CallbackNode* node, bool success){ (**node->template stored<callback_type*>())(success); };
+        m_destroy = [](CallbackNode* node){ delete *node->template stored<callback_type*>(); };
+      }
+    }
 
-    CallbackNode(std::function<void(bool)>&& callback) : m_callback(std::move(callback)) { }
+    ~CallbackNode() { m_destroy(this); }
+
+    void operator()(bool success) { m_invoke(this, success); }
+
+   private:
+    template<typename T>
+    T* stored() { return std::launder(reinterpret_cast<T*>(m_storage)); }
   };
 
-  // Constness of this object means that we have got access to it through by read-locking m_key2task.
+  struct TaskPointerAndCallbackQueue;
+
+  // Node in m_ready_list.
+  struct ReadyNode : utils::threading::MpscNode
+  {
+    TaskPointerAndCallbackQueue const* const m_entry;
+
+    ReadyNode(TaskPointerAndCallbackQueue const* entry) : m_entry(entry) { }
+  };
+
+  // Constness of this object means that we have got access to it through by read-locking (a shard of) m_shards.
   // In most cases that read-lock is even released again by the time this object is accessed.
   //
   // Concurrent access is made safe in other ways.
   //
   // The members are made mutable because this access also involves writing.
   struct TaskPointerAndCallbackQueue {
-    boost::intrusive_ptr<Task> const m_task;
+    // Only replaced (by a refreshed task) by the Broker task while holding the write lock on the shard; other threads only read it while holding the read lock.
+    mutable boost::intrusive_ptr<Task> m_task;
     // Concurrent access is fine since callbacks_type is thread safe: access is protected by its own mutex.
     mutable utils::threading::MpscQueue m_callbacks;
+    mutable std::atomic<uint32_t> m_number_of_callbacks;        // The number of nodes in m_callbacks (only used for the metrics).
     // Only when m_finished is loaded with acquire and is true, the Task that m_task points to and the boolean m_success may be read.
-    // m_finished is initialized at false and only set to true once by the Broker task, using memory_order_release.
+    // m_finished is initialized at false and only set to true once by the callback of the task, using memory_order_release.
     // Other threads only read m_success after loading m_finished with memory_order_acquire and seeing that being true - which means that
-    // it is safe for the Broker task to write to m_success before setting m_finished to true.
+    // it is safe for that callback to write to m_success before setting m_finished to true.
     mutable std::atomic<bool> m_finished;               // Set to true when the callback of the actual task is called.
     mutable bool m_success;                             // Set to the value passed to the actual callback of the task.
-    // This variable is only accessed by the Broker task; and thus it is virtually single-threaded.
-    mutable bool m_running;
+    // These variables are only accessed by the Broker task; and thus they are virtually single-threaded.
+    mutable bool m_running;                             // Set when m_task was started.
+    mutable bool m_pending;                             // Set while this entry is in m_pending, waiting for a free slot (see set_max_running).
+    mutable bool m_holds_slot;                          // Set while m_task counts towards m_number_running.
+    mutable clock_type::time_point m_started_at;        // The time at which m_task was started.
+    // Set while m_ready_node is in the ready list of the Broker (or about to be added to it).
+    mutable std::atomic<bool> m_ready;
+    mutable ReadyNode m_ready_node;
+    // The number of threads that are in run() using this entry; an entry can't be evicted while this is non-zero.
+    mutable std::atomic<int> m_users;
+    // The last time that this entry was returned by run(), as clock_type::rep.
+    mutable std::atomic<clock_type::rep> m_last_used;
+    // Stale-while-revalidate (see set_refresh_after).
+    key_type const* m_key;                                      // The key of this entry in the map (set once, before the entry can be found).
+    mutable std::atomic<clock_type::rep> m_finished_at;         // The time at which the result of m_task became available.
+    mutable std::atomic<bool> m_refresh_requested;              // Set by run() when the result is too old; reset by the Broker task when the refresh is done.
+    mutable std::atomic<bool> m_refresh_finished;               // Set when m_refresh_task finished.
+    mutable bool m_refresh_success;                             // The value passed to the callback of m_refresh_task.
+    mutable boost::intrusive_ptr<Task> m_refresh_task;          // The task that is recalculating the result (only accessed by the Broker task).
 
-    TaskPointerAndCallbackQueue(boost::intrusive_ptr<Task>&& task, std::function<void(bool)>&& callback) :
-      m_task(std::move(task)), m_finished(false), m_success(false), m_running(false) { m_callbacks.push(NEW(CallbackNode(std::move(callback)))); }
+    TaskPointerAndCallbackQueue(boost::intrusive_ptr<Task>&& task) :
+      m_task(std::move(task)), m_number_of_callbacks(0), m_finished(false), m_success(false), m_running(false), m_pending(false), m_holds_slot(false), m_ready(false), m_ready_node(this),
+      m_users(1), m_last_used(clock_type::now().time_since_epoch().count()), m_key(nullptr), m_finished_at(0),
+      m_refresh_requested(false), m_refresh_finished(false), m_refresh_success(false) { }
 
 #ifdef CWDEBUG
     void print_on(std::ostream& os) const
@@ -75,16 +169,40 @@ class Broker : public AIStatefulTask
 #endif
   };
   using unordered_map_type = std::unordered_map<
-      statefultask::BrokerKey::unique_ptr,
+      map_key_type,
       TaskPointerAndCallbackQueue,
-      statefultask::BrokerKeyHash,
-      statefultask::BrokerKeyEqual>;
+      typename key_traits::hash_type,
+      typename key_traits::equal_type>;
   using map_type = aithreadsafe::Wrapper<unordered_map_type, aithreadsafe::policy::ReadWrite<AIReadWriteMutex>>;
 
-  map_type m_key2task;
+  // The key map is split into shards, each with its own lock, so that lookups and inserts of different keys scale with the number of cores.
+  static constexpr size_t number_of_shards = 16;
+  static_assert((number_of_shards & (number_of_shards - 1)) == 0, "number_of_shards must be a power of two.");
+  struct alignas(64) Shard
+  {
+    map_type m_key2task;
+  };
+
+  // Memory resource for the CallbackNode's, so that queuing a callback doesn't call malloc (for callbacks that fit in CallbackNode::m_storage).
+  // Declared before m_shards because the entries in the shards might still contain nodes when the Broker is destroyed.
+  utils::NodeMemoryResource m_callback_nmr{AIMemoryPagePool::instance(), sizeof(CallbackNode)};
+  std::array<Shard, number_of_shards> m_shards;
+  // The entries that need the attention of the Broker task: newly created, finished or with new callbacks.
+  utils::threading::MpscQueue m_ready_list;
   bool m_is_immediate;
+  // Cache limits (see set_capacity and set_time_to_live).
+  size_t m_capacity;                            // The maximum number of entries, or zero when unlimited.
+  clock_type::duration m_time_to_live;          // The time after which an unused entry may be evicted, or zero when unlimited.
+  clock_type::time_point m_next_sweep;          // The next time that entries older than m_time_to_live are evicted.
+  std::atomic<size_t> m_size;                   // The total number of entries in m_shards.
+  clock_type::duration m_refresh_after;         // The age after which a result is recalculated in the background, or zero when never.
+  // Concurrency limit (see set_max_running); only accessed by the Broker task.
+  size_t m_max_running;                         // The maximum number of tasks that run at the same time, or zero when unlimited.
+  size_t m_number_running;                      // The number of started tasks that didn't finish yet.
+  std::deque<TaskPointerAndCallbackQueue const*> m_pending;     // Entries whose task wasn't started yet because m_max_running was reached, in FIFO order.
+  statefultask::BrokerMetrics m_metrics;        // Usage statistics (see metrics()).
   utils::threading::Gate m_finished;
-  std::tuple<CWDEBUG_ONLY(bool,) Args...> m_debugflag_task_args;
+  decltype(std::tuple_cat(std::declval<std::tuple<CWDEBUG_ONLY(bool)>>(), std::declval<typename key_traits::task_args_type>())) m_debugflag_task_args;
 
  protected:
   ~Broker() override { DoutEntering(dc::broker(mSMDebug), "~Broker() [" << (void*)this << "]"); }
@@ -93,9 +211,138 @@ class Broker : public AIStatefulTask
   void multiplex_impl(state_type run_state) override;
   void abort_impl() override;
 
+  // Return the index of the shard that contains key.
+  template<typename K>
+  static size_t shard_index(K const& key)
+  {
+    // Use the high bits of a multiplicative hash, so that the shard index doesn't correlate with the bucket index of the unordered_map.
+    uint64_t mixed = key_traits::hash(key) * 0x9e3779b97f4a7c15ULL;
+    return mixed >> (64 - std::countr_zero(number_of_shards));
+  }
+
+  // Return the shard that contains key.
+  template<typename K>
+  map_type& key2task(K const& key) { return m_shards[shard_index(key)].m_key2task; }
+
+  // The result of looking up a key in m_shards.
+  struct Lookup
+  {
+    // This must be a const* because it is set while only having a read lock on the unordered_map.
+    TaskPointerAndCallbackQueue const* m_entry = nullptr;
+    // The task, and whether it finished and succeeded; read while holding the lock on the shard because the Broker might replace the task.
+    boost::intrusive_ptr<Task const> m_task;
+    bool m_created = false;                     // Set if the entry was created by this lookup.
+    bool m_finished = false;
+    bool m_success = false;
+    bool m_need_refresh = false;                // Set when the result is stale and the Broker must recalculate it.
+  };
+
+  // Look up key in the (at least read-locked) shard map. Returns false if it isn't there.
+  template<typename K>
+  bool find_entry(unordered_map_type const& map, K const& key, Lookup& lookup);
+
+  // Create the entry for key in the write-locked shard map.
+  template<typename K>
+  void create_entry(unordered_map_type& map, K const& key, Lookup& lookup);
+
+#if CW_DEBUG
+  // The shard whose write lock is held by this thread while it calls initialize() of a key (see create_entry).
+  static inline thread_local map_type const* tl_initializing_shard = nullptr;
+#endif
+
+  // Queue callback on (or call it for) the entry that was looked up, and stop using the entry.
+  // Must be called without holding any lock. Returns true if the entry was added to m_ready_list.
+  template<typename Callback>
+  bool dispatch(Lookup& lookup, Callback&& callback);
+
+  // Look up (or create) the entries of all keys, taking each shard lock at most once (twice when entries must be created).
+  template<typename K>
+  void lookup_many(std::span<K const* const> keys, std::vector<Lookup>& lookups);
+
+  // Evict entries if the cache limits are exceeded.
+  void evict();
+
+  template<typename Callback>
+  CallbackNode* new_callback_node(Callback&& callback)
+  {
+    return new (m_callback_nmr.allocate(sizeof(CallbackNode))) CallbackNode(std::forward<Callback>(callback));
+  }
+
+  void delete_callback_node(CallbackNode* node)
+  {
+    node->~CallbackNode();
+    m_callback_nmr.deallocate(node);
+  }
+
+  // Create a new (not yet initialized) task.
+  boost::intrusive_ptr<Task> create_task()
+  {
+    return std::apply([](auto&&... args){ return statefultask::create<Task>(std::forward<decltype(args)>(args)...); }, m_debugflag_task_args);
+  }
+
+  // Called by the Broker task to run the task of entry.
+  void start_task(TaskPointerAndCallbackQueue const& entry);
+
+  // Called by the Broker task to start or finish the refresh of the result of entry.
+  void start_refresh(TaskPointerAndCallbackQueue const& entry);
+  void finish_refresh(TaskPointerAndCallbackQueue const& entry);
+
+  // Add entry to m_ready_list, unless it is already there.
+  void add_to_ready_list(TaskPointerAndCallbackQueue const& entry)
+  {
+    if (!entry.m_ready.exchange(true, std::memory_order_acq_rel))
+      m_ready_list.push(&entry.m_ready_node);
+  }
+
+  // Add entry to m_ready_list (unless it is already there) and wake up the Broker task.
+  void mark_ready(TaskPointerAndCallbackQueue const& entry)
+  {
+    add_to_ready_list(entry);
+    signal(1);
+  }
+
+  // The state shared by the callbacks of the entries of one call to run_many.
+  struct RunManyState : AIRefCount
+  {
+    std::function<void(bool)> m_completion;                     // Called once all entries finished (or empty).
+    std::function<void(size_t, bool)> m_callback;               // Called for every entry (or empty).
+    std::atomic<size_t> m_remaining;                            // The number of entries whose callback wasn't called yet.
+    std::atomic<bool> m_success;                                // Reset when one of the tasks failed.
+
+    RunManyState(size_t remaining) : m_remaining(remaining), m_success(true) { }
+
+    void finished(size_t index, bool success)
+    {
+      if (m_callback)
+        m_callback(index, success);
+      if (!success)
+        m_success.store(false, std::memory_order_relaxed);
+      if (m_remaining.fetch_sub(1, std::memory_order_acq_rel) == 1 && m_completion)
+        m_completion(m_success.load(std::memory_order_relaxed));
+    }
+  };
+
+  // The callback that run_many queues for each key.
+  struct RunManyCallback
+  {
+    boost::intrusive_ptr<RunManyState> m_state;
+    size_t m_index;                                             // The index of the key in the keys passed to run_many.
+
+    void operator()(bool success) const { m_state->finished(m_index, success); }
+  };
+  // Stored in the CallbackNode itself: queuing it doesn't allocate, and deleting the node without calling it (abort_impl) releases m_state.
+  static_assert(CallbackNode::template fits_in_node<RunManyCallback>, "RunManyCallback must fit in a CallbackNode.");
+
+  template<typename K>
+  std::vector<boost::intrusive_ptr<Task const>> run_many_impl(std::span<K const* const> keys, boost::intrusive_ptr<RunManyState> state);
+
  public:
-  Broker(CWDEBUG_ONLY(bool debug,) Args... task_args) :
-    AIStatefulTask(CWDEBUG_ONLY(debug)), m_is_immediate(false), m_debugflag_task_args(CWDEBUG_ONLY(debug,) task_args...)
+  template<typename... TaskArgs>
+  requires std::is_constructible_v<typename key_traits::task_args_type, TaskArgs...>
+  Broker(CWDEBUG_ONLY(bool debug,) TaskArgs&&... task_args) :
+    AIStatefulTask(CWDEBUG_ONLY(debug)), m_is_immediate(false),
+    m_capacity(0), m_time_to_live(clock_type::duration::zero()), m_size(0),
+    m_refresh_after(clock_type::duration::zero()), m_max_running(0), m_number_running(0), m_debugflag_task_args(CWDEBUG_ONLY(debug,) std::forward<TaskArgs>(task_args)...)
   {
     DoutEntering(dc::broker(mSMDebug), "Broker<" <<
         libcwd::type_info_of<Task>().demangled_name() <<
@@ -117,99 +364,392 @@ class Broker : public AIStatefulTask
     });
   }
 
+  // Limit the number of cached entries to (approximately) capacity.
+  // When exceeded, the least recently used entries whose task finished and that are no longer referenced are evicted.
+  // Must be called before run().
+  void set_capacity(size_t capacity) { m_capacity = capacity; }
+
+  // Evict entries whose task finished and that are no longer referenced, once they weren't used for time_to_live.
+  // Entries are only evicted while the Broker is woken up by new requests. Must be called before run().
+  void set_time_to_live(clock_type::duration time_to_live) { m_time_to_live = time_to_live; }
+
+  // Recalculate results once they are older than refresh_after (stale-while-revalidate):
+  // the first run(key, callback) after that gets the current result immediately, while the Broker
+  // runs a new task for key in the background. Once that finished successfully it replaces the old one.
+  // Must be called before run().
+  void set_refresh_after(clock_type::duration refresh_after) { m_refresh_after = refresh_after; }
+
+  // Do not run more than max_running tasks at the same time (zero means unlimited).
+  // The tasks of new entries beyond that are started in the order in which they were requested, as running tasks finish.
+  // Background refreshes (see set_refresh_after) are not limited. Must be called before run().
+  void set_max_running(size_t max_running) { m_max_running = max_running; }
+
+  // Return the usage statistics of this Broker collected so far.
+  statefultask::BrokerMetrics::Stats metrics() const { return m_metrics.snapshot(m_size.load(std::memory_order_relaxed)); }
+
   void terminate()
   {
     abort();
     m_finished.wait();
   }
 
-  // Abort and run callback(task) for each task in m_key2task.
+  // Abort and run callback(task) for each task in m_shards.
   void terminate(std::function<void (Task*)> callback)
   {
     terminate();
-    typename map_type::wat key2task_w(m_key2task);
-    for (auto& element : *key2task_w)
-      callback(element.second.m_task.get());
+    for (Shard& shard : m_shards)
+    {
+      typename map_type::wat key2task_w(shard.m_key2task);
+      for (auto& element : *key2task_w)
+        callback(element.second.m_task.get());
+    }
   }
 
   // The returned pointer is meant to keep the task alive, not to access it (it is possibly shared between threads).
   // Read access is allowed only after (during) the callback was called.
-  boost::intrusive_ptr<Task const> run(statefultask::BrokerKey const& key, std::function<void(bool)>&& callback);
+  //
+  // key is a statefultask::BrokerKey, or for a Broker with TypedBrokerKey<Key> anything that can be looked up in a map of Key's.
+  // callback is any callable that can be called with a bool; it is moved into the queue (see the comment above class Broker).
+  template<typename K, typename Callback>
+  requires std::is_invocable_v<std::decay_t<Callback>&, bool>
+  boost::intrusive_ptr<Task const> run(K const& key, Callback&& callback);
+
+  // Bulk version of run(key, callback): look up or create the entries of all keys while taking the lock
+  // of each shard only once, and wake up the Broker task only once.
+  //
+  // completion is called once, after the tasks of all keys finished, with true iff all of them succeeded.
+  // The returned tasks are in the same order as keys.
+  template<typename K>
+  std::vector<boost::intrusive_ptr<Task const>> run_many(std::span<K const* const> keys, std::function<void(bool)>&& completion)
+  {
+    boost::intrusive_ptr<RunManyState> state = new RunManyState(keys.size());
+    state->m_completion = std::move(completion);
+    if (keys.empty())
+      state->m_completion(true);
+    return run_many_impl(keys, std::move(state));
+  }
+
+  // As above, but call callback(index, success) for each key, where index is the index of the key in keys.
+  template<typename K>
+  std::vector<boost::intrusive_ptr<Task const>> run_many(std::span<K const* const> keys, std::function<void(size_t, bool)>&& callback)
+  {
+    boost::intrusive_ptr<RunManyState> state = new RunManyState(keys.size());
+    state->m_callback = std::move(callback);
+    return run_many_impl(keys, std::move(state));
+  }
 };
 
 template<TaskType Task, typename... Args>
-boost::intrusive_ptr<Task const> Broker<Task, Args...>::run(statefultask::BrokerKey const& key, std::function<void(bool)>&& callback)
+template<typename K>
+bool Broker<Task, Args...>::find_entry(unordered_map_type const& map, K const& key, Lookup& lookup)
+{
+  auto search = map.find(key_traits::lookup_key(key));
+  if (search == map.end())
+    return false;
+  // Store a pointer to the element in the unordered_map; note that pointers (and references)
+  // to elements of an unorder_map are never invalidated, unless the element itself is erased.
+  TaskPointerAndCallbackQueue const* entry = &search->second;
+  lookup.m_entry = entry;
+  // Stop the entry from being evicted while we use it.
+  entry->m_users.fetch_add(1, std::memory_order_relaxed);
+  lookup.m_task = entry->m_task;
+  lookup.m_finished = entry->m_finished.load(std::memory_order_acquire);
+  if (lookup.m_finished)
+  {
+    lookup.m_success = entry->m_success;
+    if (m_refresh_after != clock_type::duration::zero() &&
+        !entry->m_refresh_requested.load(std::memory_order_relaxed) &&
+        clock_type::now().time_since_epoch().count() - entry->m_finished_at.load(std::memory_order_relaxed) >= m_refresh_after.count())
+      lookup.m_need_refresh = !entry->m_refresh_requested.exchange(true, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+template<TaskType Task, typename... Args>
+template<typename K>
+void Broker<Task, Args...>::create_entry(unordered_map_type& map, K const& key, Lookup& lookup)
+{
+  // Create the task and put the boost::intrusive_ptr to it into the unordered_map under key.
+  boost::intrusive_ptr<Task> new_task = create_task();
+  map_key_type map_key = key_traits::copy(key);
+  // Initialize the task before other threads can find it.
+#if CW_DEBUG
+  map_type const* outer_shard = tl_initializing_shard;
+  tl_initializing_shard = &key2task(key);
+#endif
+  key_traits::key_ptr(map_key)->initialize(new_task);
+#if CW_DEBUG
+  tl_initializing_shard = outer_shard;
+#endif
+  // The tasks of a Broker are referenced from any thread, they can't be thread confined.
+  ASSERT(!new_task->is_thread_confined());
+  lookup.m_task = new_task;
+  auto result = map.try_emplace(std::move(map_key), std::move(new_task)).first;      // Initializes m_users to 1.
+  result->second.m_key = key_traits::key_ptr(result->first);
+  lookup.m_entry = &result->second;
+  lookup.m_created = true;
+  m_size.fetch_add(1, std::memory_order_relaxed);
+}
+
+template<TaskType Task, typename... Args>
+template<typename Callback>
+bool Broker<Task, Args...>::dispatch(Lookup& lookup, Callback&& callback)
+{
+  TaskPointerAndCallbackQueue const* entry = lookup.m_entry;
+  bool ready = false;
+  if (lookup.m_created)
+  {
+    m_metrics.miss();
+    Dout(dc::broker, "Wake up Broker to run the newly created task.");
+    // Count the node before pushing it, so that the Broker task never subtracts it first.
+    m_metrics.callback_queued(entry->m_number_of_callbacks.fetch_add(1, std::memory_order_relaxed) + 1);
+    entry->m_callbacks.push(new_callback_node(std::forward<Callback>(callback)));
+    ready = true;
+  }
+  else
+  {
+    if (lookup.m_finished)
+      m_metrics.finished_hit();
+    else
+      m_metrics.running_hit();
+    Dout(dc::broker(lookup.m_finished), "This task already finished.");
+    if (lookup.m_need_refresh)
+    {
+      Dout(dc::broker, "The result is stale: wake up the Broker task to refresh it.");
+      ready = true;
+    }
+    if (lookup.m_finished && m_is_immediate)
+      callback(lookup.m_success);
+    else
+    {
+      Dout(dc::broker, "Adding callback to the queue and wake up the Broker task.");
+      // Queue the call back.
+      // Count the node before pushing it, so that the Broker task never subtracts it first.
+      m_metrics.callback_queued(entry->m_number_of_callbacks.fetch_add(1, std::memory_order_relaxed) + 1);
+      entry->m_callbacks.push(new_callback_node(std::forward<Callback>(callback)));
+      ready = true;
+    }
+  }
+  if (ready)
+    add_to_ready_list(*entry);
+  // Done using entry.
+  entry->m_last_used.store(clock_type::now().time_since_epoch().count(), std::memory_order_relaxed);
+  entry->m_users.fetch_sub(1, std::memory_order_release);
+  return ready;
+}
+
+template<TaskType Task, typename... Args>
+template<typename K, typename Callback>
+requires std::is_invocable_v<std::decay_t<Callback>&, bool>
+boost::intrusive_ptr<Task const> Broker<Task, Args...>::run(K const& key, Callback&& callback)
 {
   DoutEntering(dc::broker, "Broker<" << libcwd::type_info_of<Task>().demangled_name() << ", void>::run(" << key << ", callback)");
   // This function returns a pointer to an immutable Task, because the returned
   // task is shared between threads and readonly. Note that reading it is only allowed
   // after the task finished running because otherwise writing may occur at the same
   // time, which is UB.
-  // This must be a const* because we set it while only having a read lock on the unordered_map.
-  typename unordered_map_type::mapped_type const* entry;
-  // A boolean indicating if a task with the required key already existed or not.
-  bool task_created;
-  for (;;)
+  Lookup lookup;
+  // The shard that contains key.
+  map_type& key2task_shard{key2task(key)};
+  // Called from the initialize() of a key in the same shard; that would deadlock (see BrokerKey::initialize).
+  ASSERT(&key2task_shard != tl_initializing_shard);
+  bool found;
+  {
+    // Obtain a read-lock and read-access to the shard of m_shards that contains key.
+    typename map_type::rat key2task_r(key2task_shard);
+    found = find_entry(*key2task_r, key, lookup);
+  }
+  if (!found)
+  {
+    // The task wasn't created yet (when we looked). In order to create it we need the write lock.
+    // Rather than upgrading the read lock (which fails when another thread tries the same),
+    // release it, obtain the write lock and check again: another thread might have created the task in the meantime.
+    typename map_type::wat key2task_w(key2task_shard);
+    if (!find_entry(*key2task_w, key, lookup))
+      create_entry(*key2task_w, key, lookup);
+  }
+  if (dispatch(lookup, std::forward<Callback>(callback)))
+    signal(1);
+  return std::move(lookup.m_task);
+}
+
+template<TaskType Task, typename... Args>
+template<typename K>
+void Broker<Task, Args...>::lookup_many(std::span<K const* const> keys, std::vector<Lookup>& lookups)
+{
+  size_t const number_of_keys = keys.size();
+  std::vector<uint8_t> shard_of(number_of_keys);
+  std::array<size_t, number_of_shards> keys_per_shard{};
+  for (size_t i = 0; i < number_of_keys; ++i)
   {
-    try
+    shard_of[i] = shard_index(*keys[i]);
+    ++keys_per_shard[shard_of[i]];
+  }
+  for (size_t shard = 0; shard < number_of_shards; ++shard)
+  {
+    if (keys_per_shard[shard] == 0)
+      continue;
+    map_type& key2task_shard{m_shards[shard].m_key2task};
+    // See run(key, callback).
+    ASSERT(&key2task_shard != tl_initializing_shard);
+    size_t missing = 0;
     {
-      // Obtain a read-lock and read-access to m_key2task.
-      typename map_type::rat key2task_r(m_key2task);
-      // The cast is necessary because find() requires the non-const BrokerKey::unique_ptr reference
-      // (as opposed to BrokerKey::const_unique_ptr). It is safe because find() will not alter the
-      // BrokerKey pointed to.
-      auto search = key2task_r->find(const_cast<statefultask::BrokerKey&>(key).non_owning_ptr());
-      if ((task_created = search == key2task_r->end()))
-      {
-        // The task wasn't created yet.
-        // In order to do so, we have to obtain the write lock first.
-        typename map_type::wat key2task_w(key2task_r);                         // This might throw.
-        // Create the task and put the boost::intrusive_ptr to it into the unordered_map together with a CallbackQueue object
-        // already filled with callback, under key. Store the pointer to the new pair into entry.
-        boost::intrusive_ptr<Task> task = std::apply([](auto&&... args){ return statefultask::create<Task>(std::forward<decltype(args)>(args)...); }, m_debugflag_task_args);
-        entry = &key2task_w->try_emplace(key.copy(), std::move(task), std::move(callback)).first->second;
-      }
-      else
-      {
-        // The task already exists. Store a pointer to the element in the unordered_map; note that
-        // pointers (and references) to elements of an unorder_map are never invalidated, unless
-        // the element itself is erased.
-        entry = &search->second;
-      }
-      break;
+      typename map_type::rat key2task_r(key2task_shard);
+      for (size_t i = 0; i < number_of_keys; ++i)
+        if (shard_of[i] == shard && !find_entry(*key2task_r, *keys[i], lookups[i]))
+          ++missing;
     }
-    catch (std::exception const&)
+    if (missing == 0)
+      continue;
+    // See run(key, callback).
+    typename map_type::wat key2task_w(key2task_shard);
+    for (size_t i = 0; i < number_of_keys; ++i)
+      if (shard_of[i] == shard && !lookups[i].m_entry && !find_entry(*key2task_w, *keys[i], lookups[i]))
+        create_entry(*key2task_w, *keys[i], lookups[i]);
+  }
+}
+
+template<TaskType Task, typename... Args>
+template<typename K>
+std::vector<boost::intrusive_ptr<Task const>> Broker<Task, Args...>::run_many_impl(std::span<K const* const> keys, boost::intrusive_ptr<RunManyState> state)
+{
+  DoutEntering(dc::broker, "Broker<" << libcwd::type_info_of<Task>().demangled_name() << ">::run_many(" << keys.size() << " keys, callback)");
+  size_t const number_of_keys = keys.size();
+  std::vector<Lookup> lookups(number_of_keys);
+  lookup_many(keys, lookups);
+  std::vector<boost::intrusive_ptr<Task const>> tasks;
+  tasks.reserve(number_of_keys);
+  bool need_signal = false;
+  for (size_t i = 0; i < number_of_keys; ++i)
+  {
+    if (dispatch(lookups[i], RunManyCallback{state, i}))
+      need_signal = true;
+    tasks.push_back(std::move(lookups[i].m_task));
+  }
+  // Wake up the Broker task only once.
+  if (need_signal)
+    signal(1);
+  return tasks;
+}
+
+template<TaskType Task, typename... Args>
+void Broker<Task, Args...>::evict()
+{
+  clock_type::time_point const now = clock_type::now();
+  bool const over_capacity = m_capacity > 0 && m_size.load(std::memory_order_relaxed) > m_capacity;
+  bool const sweep = m_time_to_live != clock_type::duration::zero() && now >= m_next_sweep;
+  if (!over_capacity && !sweep)
+    return;
+  if (sweep)
+    m_next_sweep = now + m_time_to_live / 4;
+  DoutEntering(dc::broker(mSMDebug), "Broker<" << libcwd::type_info_of<Task>().demangled_name() << ">::evict()");
+  // Each shard is limited to its share of the capacity.
+  size_t const shard_capacity = std::max(m_capacity / number_of_shards, size_t{1});
+  clock_type::rep const expired = (now - m_time_to_live).time_since_epoch().count();
+  std::vector<typename unordered_map_type::iterator> candidates;
+  for (Shard& shard : m_shards)
+  {
+    // While we have the write lock no other thread can start using an entry (see run()).
+    typename map_type::wat key2task_w(shard.m_key2task);
+    bool const shard_over_capacity = over_capacity && key2task_w->size() > shard_capacity;
+    if (!shard_over_capacity && !sweep)
+      continue;
+    candidates.clear();
+    for (auto it = key2task_w->begin(); it != key2task_w->end(); ++it)
+    {
+      TaskPointerAndCallbackQueue const& entry{it->second};
+      // Only evict entries whose task finished, whose callbacks were all called,
+      // that are not used by run() and whose task is not referenced anymore.
+      // Test m_finished first: the callback of the task increments m_users before setting it.
+      if (entry.m_finished.load(std::memory_order_acquire) &&
+          entry.m_users.load(std::memory_order_acquire) == 0 &&
+          !entry.m_ready.load(std::memory_order_acquire) &&
+          !entry.m_refresh_task &&
+          entry.m_task->unique())
+        candidates.push_back(it);
+    }
+    // Least recently used first.
+    std::sort(candidates.begin(), candidates.end(), [](auto const& a, auto const& b){
+        return a->second.m_last_used.load(std::memory_order_relaxed) < b->second.m_last_used.load(std::memory_order_relaxed); });
+    for (auto it : candidates)
     {
-      // Another thread is already trying to convert its read-lock into a write-lock.
-      // Let that thread grab it and create the task.
-      m_key2task.rd2wryield();
+      bool const is_expired = sweep && it->second.m_last_used.load(std::memory_order_relaxed) <= expired;
+      bool const need_room = shard_over_capacity && key2task_w->size() > shard_capacity;
+      // The remaining candidates were used more recently.
+      if (!is_expired && !need_room)
+        break;
+      Dout(dc::broker(mSMDebug), "Evicting " << it->second << " [" << *key_traits::key_ptr(it->first) << "]");
+      key2task_w->erase(it);
+      m_size.fetch_sub(1, std::memory_order_relaxed);
     }
   }
-  if (task_created)
+}
+
+template<TaskType Task, typename... Args>
+void Broker<Task, Args...>::start_task(TaskPointerAndCallbackQueue const& entry)
+{
+  entry.m_running = true;
+  if (m_max_running > 0)
   {
-    // It is safe to do this without a read or write lock on m_key2task, because no
-    // other threads are accessing the (just created) Task. They are just waiting for
-    // it to be finished.
-    key.initialize(entry->m_task);
-    // Wake up the Broker task.
-    Dout(dc::broker, "Wake up Broker to run the newly created task.");
-    signal(1);
+    entry.m_holds_slot = true;
+    ++m_number_running;
+  }
+  entry.m_started_at = clock_type::now();
+  // Run the newly created task, adding the entry to the ready list again when it is done.
+  entry.m_task->run([broker = boost::intrusive_ptr<Broker>(this), &entry](bool success){
+      // Stop the entry from being evicted before we are done with it.
+      entry.m_users.fetch_add(1, std::memory_order_relaxed);
+      clock_type::time_point const now = clock_type::now();
+      broker->m_metrics.task_finished(now - entry.m_started_at);
+      entry.m_success = success;
+      entry.m_finished_at.store(now.time_since_epoch().count(), std::memory_order_relaxed);
+      entry.m_finished.store(true, std::memory_order_release);
+      broker->mark_ready(entry);
+      entry.m_users.fetch_sub(1, std::memory_order_release);
+  });
+}
+
+template<TaskType Task, typename... Args>
+void Broker<Task, Args...>::start_refresh(TaskPointerAndCallbackQueue const& entry)
+{
+  DoutEntering(dc::broker(mSMDebug), "Broker<" << libcwd::type_info_of<Task>().demangled_name() << ">::start_refresh(" << entry << ")");
+  entry.m_refresh_task = create_task();
+  entry.m_key->initialize(entry.m_refresh_task);
+  // See create_entry.
+  ASSERT(!entry.m_refresh_task->is_thread_confined());
+  entry.m_refresh_task->run([broker = boost::intrusive_ptr<Broker>(this), &entry, started_at = clock_type::now()](bool success){
+      entry.m_users.fetch_add(1, std::memory_order_relaxed);
+      broker->m_metrics.task_finished(clock_type::now() - started_at);
+      entry.m_refresh_success = success;
+      entry.m_refresh_finished.store(true, std::memory_order_release);
+      broker->mark_ready(entry);
+      entry.m_users.fetch_sub(1, std::memory_order_release);
+  });
+}
+
+template<TaskType Task, typename... Args>
+void Broker<Task, Args...>::finish_refresh(TaskPointerAndCallbackQueue const& entry)
+{
+  DoutEntering(dc::broker(mSMDebug), "Broker<" << libcwd::type_info_of<Task>().demangled_name() << ">::finish_refresh(" << entry << ")");
+  boost::intrusive_ptr<Task> old_task;
+  if (entry.m_refresh_success)
+  {
+    // Swap in the new task. Threads that are using the old task keep it alive.
+    typename map_type::wat key2task_w(key2task(*entry.m_key));
+    old_task = std::move(entry.m_task);
+    entry.m_task = std::move(entry.m_refresh_task);
+    entry.m_success = true;
+    entry.m_finished_at.store(clock_type::now().time_since_epoch().count(), std::memory_order_relaxed);
   }
   else
   {
-    bool finished = entry->m_finished.load(std::memory_order_acquire);
-    Dout(dc::broker(finished), "This task already finished.");
-    if (finished && m_is_immediate)
-      callback(entry->m_success);
-    else
-    {
-      Dout(dc::broker, "Adding callback to the queue and wake up the Broker task.");
-      // Queue the call back.
-      entry->m_callbacks.push(NEW(CallbackNode(std::move(callback))));
-      signal(1);
-    }
+    // Keep serving the old result; the next request will try again.
+    Dout(dc::broker(mSMDebug), "Refresh failed.");
+    old_task = std::move(entry.m_refresh_task);
   }
-  return entry->m_task;
+  entry.m_refresh_task.reset();
+  entry.m_refresh_finished.store(false, std::memory_order_relaxed);
+  entry.m_refresh_requested.store(false, std::memory_order_release);
 }
 
 template<TaskType Task, typename... Args>
@@ -241,46 +781,76 @@ void Broker<Task, Args...>::multiplex_impl(state_type run_state)
       break;
     case Broker_do_work:
     {
-      // New callbacks have been added. A new task might also have been added however and needs to be run.
-      // Get read access to the map with tasks.
+      // New callbacks have been added, a new task was added and needs to be run, or a task finished.
+      // Only process the entries that need attention.
+      utils::threading::MpscNode* ready_node;
+      while ((ready_node = m_ready_list.pop()))
       {
-        typename map_type::rat key2task_r(m_key2task);
-#ifdef CWDEBUG
-        int size = key2task_r->size();
-        Dout(dc::broker(mSMDebug), ((size == 1) ? "There is " : "There are ") << size << " registered task" << ((size == 1) ? "." : "s."));
-#endif
-        for (typename unordered_map_type::const_iterator it = key2task_r->begin(); it != key2task_r->end(); ++it)
+        TaskPointerAndCallbackQueue const& entry{*static_cast<ReadyNode*>(ready_node)->m_entry};
+        // Reset m_ready before processing the entry, so that events that happen from now on add it again.
+        entry.m_ready.store(false, std::memory_order_release);
+        Dout(dc::broker(mSMDebug)|continued_cf, "Processing entry " << entry << "; ");
+        if (!entry.m_running)
         {
-          statefultask::BrokerKey::unique_ptr const& key{it->first};
-          TaskPointerAndCallbackQueue const& entry{it->second};
-          Dout(dc::broker(mSMDebug)|continued_cf, "Processing entry " << entry << " [" << *key  << "]; ");
-          if (!entry.m_running)
+          if (entry.m_pending)
+            Dout(dc::finish, "skipping: waiting for a free slot.");
+          else if (m_max_running > 0 && m_number_running >= m_max_running)
+          {
+            Dout(dc::finish, "the maximum number of running tasks is reached; queued.");
+            entry.m_pending = true;
+            m_pending.push_back(&entry);
+          }
+          else
           {
-            entry.m_running = true;
             Dout(dc::broker(mSMDebug), "The task of this entry wasn't started yet. Calling run() now:");
-            // Run the newly created task, causing a wake up of the Broker when it is done.
-            entry.m_task->run(this, 1, signal_parent);
+            start_task(entry);
             Dout(dc::finish, "returned from run().");
           }
-          else if (entry.m_task->finished())
+        }
+        else if (entry.m_finished.load(std::memory_order_acquire))
+        {
+          if (entry.m_holds_slot)
+          {
+            // The task finished; free its slot.
+            entry.m_holds_slot = false;
+            --m_number_running;
+          }
+          if (entry.m_refresh_finished.load(std::memory_order_acquire))
+            finish_refresh(entry);
+          else if (entry.m_refresh_requested.load(std::memory_order_relaxed) && !entry.m_refresh_task)
+            start_refresh(entry);
+          // The task finished.
+          CallbackNode* head;
+          uint64_t number_of_callbacks = 0;
+          // Call all the callbacks that were registered so far.
+          while ((head = static_cast<CallbackNode*>(entry.m_callbacks.pop())))
           {
-            entry.m_success = !entry.m_task->aborted();
-            entry.m_finished.store(true, std::memory_order_release);
-            // The task finished.
-            CallbackNode* head;
-            // Call all the callbacks that were registered so far.
-            while ((head = static_cast<CallbackNode*>(entry.m_callbacks.pop())))
-            {
-              CallbackNode* node = static_cast<CallbackNode*>(head);
-              node->m_callback(entry.m_success);
-              delete node;
-            }
-            Dout(dc::finish, "callback queue cleared.");
+            CallbackNode* node = static_cast<CallbackNode*>(head);
+            (*node)(entry.m_success);
+            delete_callback_node(node);
+            ++number_of_callbacks;
           }
-          else
-            Dout(dc::finish, "skipping: not finished.");
+          if (number_of_callbacks > 0)
+          {
+            entry.m_number_of_callbacks.fetch_sub(number_of_callbacks, std::memory_order_relaxed);
+            m_metrics.callbacks_removed(number_of_callbacks);
+          }
+          Dout(dc::finish, "callback queue cleared.");
         }
+        else
+          Dout(dc::finish, "skipping: not finished.");
       }
+      // Start pending tasks, in FIFO order, as long as there are free slots.
+      while (!m_pending.empty() && m_number_running < m_max_running)
+      {
+        TaskPointerAndCallbackQueue const& entry{*m_pending.front()};
+        m_pending.pop_front();
+        entry.m_pending = false;
+        Dout(dc::broker(mSMDebug), "Starting pending task of entry " << entry << ".");
+        start_task(entry);
+      }
+      if (m_capacity > 0 || m_time_to_live != clock_type::duration::zero())
+        evict();
       Dout(dc::broker, "Waiting for more work...");
       wait(1);
       break;
@@ -292,16 +862,28 @@ template<TaskType Task, typename... Args>
 void Broker<Task, Args...>::abort_impl()
 {
   DoutEntering(dc::broker(mSMDebug), "Broker<"<< libcwd::type_info_of<Task>().demangled_name() << ">::abort_impl()");
-  typename map_type::rat key2task_r(m_key2task);
-  for (typename unordered_map_type::const_iterator it = key2task_r->begin(); it != key2task_r->end(); ++it)
+  for (Shard& shard : m_shards)
   {
-    TaskPointerAndCallbackQueue const& entry{it->second};
-    entry.m_task->abort();
-    utils::threading::MpscNode* head;
-    while ((head = entry.m_callbacks.pop()))
+    typename map_type::rat key2task_r(shard.m_key2task);
+    for (typename unordered_map_type::const_iterator it = key2task_r->begin(); it != key2task_r->end(); ++it)
     {
-      CallbackNode* node = static_cast<CallbackNode*>(head);
-      delete node;
+      TaskPointerAndCallbackQueue const& entry{it->second};
+      entry.m_task->abort();
+      if (entry.m_refresh_task)
+        entry.m_refresh_task->abort();
+      utils::threading::MpscNode* head;
+      uint64_t number_of_callbacks = 0;
+      while ((head = entry.m_callbacks.pop()))
+      {
+        CallbackNode* node = static_cast<CallbackNode*>(head);
+        delete_callback_node(node);
+        ++number_of_callbacks;
+      }
+      if (number_of_callbacks > 0)
+      {
+        entry.m_number_of_callbacks.fetch_sub(number_of_callbacks, std::memory_order_relaxed);
+        m_metrics.callbacks_removed(number_of_callbacks);
+      }
     }
   }
 }
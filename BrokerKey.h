@@ -3,6 +3,10 @@
 #include <boost/intrusive_ptr.hpp>
 #include <iosfwd>
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include <tuple>
+#include <typeinfo>
 
 class AIStatefulTask;
 
@@ -23,6 +27,13 @@ class BrokerKey
   virtual ~BrokerKey() = default;
 
   virtual uint64_t hash() const = 0;
+  // Initialize a newly created task for this key.
+  //
+  // This is called while the Broker holds the write lock on the shard of its map that
+  // contains this key, so it may not call run() or run_many() of the same Broker for
+  // a key that is in the same shard: that would deadlock. Since the shard depends on
+  // the hash, simply don't call the Broker from here (debug builds assert on it).
+  // Nor may it call set_thread_confined() on the task: the Broker shares its tasks between threads.
   virtual void initialize(boost::intrusive_ptr<AIStatefulTask> task) const = 0;
   virtual unique_ptr copy() const = 0;
 #ifdef CWDEBUG
@@ -49,4 +60,82 @@ struct BrokerKeyEqual
   bool operator()(BrokerKey::unique_ptr const& left, BrokerKey::unique_ptr const& right) const { return left->equal_to(*right); }
 };
 
+// TypedBrokerKey
+//
+// Pass TypedBrokerKey<Key> as the first argument after the task type to use
+// value-type keys instead of (virtual) BrokerKey's:
+//
+//   task::Broker<MyTask, statefultask::TypedBrokerKey<MyKey>, TaskArgs...> broker;
+//
+// The keys are stored inline in the map of the Broker. Key must provide
+//
+//   uint64_t hash() const;
+//   bool operator==(Key const&) const;
+//   void initialize(boost::intrusive_ptr<MyTask> const& task) const;
+//
+// where initialize is subject to the same restriction as BrokerKey::initialize.
+//
+// Broker::run accepts any type K (for example a string_view when Key contains a string)
+// that Key can be constructed from, that has a hash() returning the same value as the
+// corresponding Key and that is equality comparable with Key (heterogeneous lookup).
+// Lookups therefore don't allocate memory and don't use virtual functions.
+//
+// In debug builds (CWDEBUG) the Broker writes the keys to its debug output, so
+// there Key and every lookup type K must also be printable: provide either
+//
+//   void print_on(std::ostream& os) const;
+//
+// or an operator<<(std::ostream&, Key const&) that can be found by ADL.
+//
+template<typename Key>
+struct TypedBrokerKey
+{
+};
+
+struct TypedBrokerKeyHash
+{
+  using is_transparent = void;
+
+  template<typename K>
+  uint64_t operator()(K const& key) const { return key.hash(); }
+};
+
+// BrokerKeyTraits
+//
+// Used by Broker to abstract the difference between BrokerKey and TypedBrokerKey keys.
+//
+template<typename... Args>
+struct BrokerKeyTraits
+{
+  using map_key_type = BrokerKey::unique_ptr;
+  using hash_type = BrokerKeyHash;
+  using equal_type = BrokerKeyEqual;
+  using task_args_type = std::tuple<Args...>;
+
+  // The cast is necessary because find() requires the non-const BrokerKey::unique_ptr reference
+  // (as opposed to BrokerKey::const_unique_ptr). It is safe because find() will not alter the
+  // BrokerKey pointed to.
+  static map_key_type lookup_key(BrokerKey const& key) { return const_cast<BrokerKey&>(key).non_owning_ptr(); }
+  static map_key_type copy(BrokerKey const& key) { return key.copy(); }
+  static BrokerKey const* key_ptr(map_key_type const& map_key) { return map_key.get(); }
+  static uint64_t hash(BrokerKey const& key) { return key.hash(); }
+};
+
+template<typename Key, typename... Args>
+struct BrokerKeyTraits<TypedBrokerKey<Key>, Args...>
+{
+  using map_key_type = Key;
+  using hash_type = TypedBrokerKeyHash;
+  using equal_type = std::equal_to<>;
+  using task_args_type = std::tuple<Args...>;
+
+  template<typename K>
+  static K const& lookup_key(K const& key) { return key; }
+  template<typename K>
+  static map_key_type copy(K const& key) { return map_key_type(key); }
+  static Key const* key_ptr(map_key_type const& map_key) { return &map_key; }
+  template<typename K>
+  static uint64_t hash(K const& key) { return key.hash(); }
+};
+
 } // namespace statefultask
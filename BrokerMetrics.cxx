@@ -0,0 +1,116 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Implementation of BrokerMetrics.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "BrokerMetrics.h"
+#include <algorithm>
+#include <bit>
+#include <iostream>
+
+namespace statefultask {
+
+void BrokerMetrics::callback_queued(uint64_t queue_length)
+{
+  m_queued_callbacks.fetch_add(1, std::memory_order_relaxed);
+  m_queue_length_samples.fetch_add(1, std::memory_order_relaxed);
+  m_queue_length_sum.fetch_add(queue_length, std::memory_order_relaxed);
+  uint64_t max_queue_length = m_max_queue_length.load(std::memory_order_relaxed);
+  while (queue_length > max_queue_length &&
+      !m_max_queue_length.compare_exchange_weak(max_queue_length, queue_length, std::memory_order_relaxed))
+    ;
+}
+
+void BrokerMetrics::task_finished(clock_type::duration run_time)
+{
+  uint64_t const run_time_ns = std::max(std::chrono::duration_cast<std::chrono::nanoseconds>(run_time).count(), int64_t{0});
+  m_tasks_finished.fetch_add(1, std::memory_order_relaxed);
+  m_total_run_time_ns.fetch_add(run_time_ns, std::memory_order_relaxed);
+  uint64_t max_run_time_ns = m_max_run_time_ns.load(std::memory_order_relaxed);
+  while (run_time_ns > max_run_time_ns &&
+      !m_max_run_time_ns.compare_exchange_weak(max_run_time_ns, run_time_ns, std::memory_order_relaxed))
+    ;
+  size_t const bucket = run_time_ns == 0 ? 0 : std::min<size_t>(std::bit_width(run_time_ns) - 1, number_of_buckets - 1);
+  m_run_time_histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+BrokerMetrics::Stats BrokerMetrics::snapshot(size_t size) const
+{
+  using std::chrono::nanoseconds;
+  using std::chrono::duration_cast;
+  Stats stats;
+  stats.m_lookups = m_lookups.load(std::memory_order_relaxed);
+  stats.m_finished_hits = m_finished_hits.load(std::memory_order_relaxed);
+  stats.m_running_hits = m_running_hits.load(std::memory_order_relaxed);
+  stats.m_misses = m_misses.load(std::memory_order_relaxed);
+  stats.m_tasks_finished = m_tasks_finished.load(std::memory_order_relaxed);
+  if (stats.m_tasks_finished > 0)
+    stats.m_average_run_time = duration_cast<clock_type::duration>(nanoseconds(m_total_run_time_ns.load(std::memory_order_relaxed) / stats.m_tasks_finished));
+  stats.m_max_run_time = duration_cast<clock_type::duration>(nanoseconds(m_max_run_time_ns.load(std::memory_order_relaxed)));
+  // Find the bucket that contains the 99th percentile.
+  std::array<uint64_t, number_of_buckets> histogram;
+  uint64_t total = 0;
+  for (size_t bucket = 0; bucket < number_of_buckets; ++bucket)
+    total += histogram[bucket] = m_run_time_histogram[bucket].load(std::memory_order_relaxed);
+  uint64_t const threshold = total - total / 100;
+  uint64_t count = 0;
+  for (size_t bucket = 0; bucket < number_of_buckets && total > 0; ++bucket)
+  {
+    count += histogram[bucket];
+    if (count >= threshold)
+    {
+      // The upper bound of this bucket, but not more than the longest run time seen.
+      stats.m_p99_run_time = std::min(stats.m_max_run_time, duration_cast<clock_type::duration>(nanoseconds(uint64_t{2} << bucket)));
+      break;
+    }
+  }
+  stats.m_queued_callbacks = std::max(m_queued_callbacks.load(std::memory_order_relaxed), int64_t{0});
+  uint64_t const queue_length_samples = m_queue_length_samples.load(std::memory_order_relaxed);
+  if (queue_length_samples > 0)
+    stats.m_average_queue_length = static_cast<double>(m_queue_length_sum.load(std::memory_order_relaxed)) / queue_length_samples;
+  stats.m_max_queue_length = m_max_queue_length.load(std::memory_order_relaxed);
+  stats.m_size = size;
+  return stats;
+}
+
+void BrokerMetrics::Stats::print_on(std::ostream& os) const
+{
+  using std::chrono::duration_cast;
+  using std::chrono::microseconds;
+  os << "lookups:" << m_lookups <<
+      ", finished hits:" << m_finished_hits <<
+      ", running hits:" << m_running_hits <<
+      ", misses:" << m_misses <<
+      ", tasks finished:" << m_tasks_finished <<
+      ", run time:" << duration_cast<microseconds>(m_average_run_time).count() << " us average" <<
+      " (p99 " << duration_cast<microseconds>(m_p99_run_time).count() << " us" <<
+      ", max " << duration_cast<microseconds>(m_max_run_time).count() << " us)" <<
+      ", queued callbacks:" << m_queued_callbacks <<
+      ", queue length:" << m_average_queue_length << " average (max " << m_max_queue_length << ")" <<
+      ", size:" << m_size;
+}
+
+} // namespace statefultask
@@ -0,0 +1,109 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Usage statistics of a task::Broker. Declaration of class BrokerMetrics.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+
+namespace statefultask {
+
+// Usage statistics of one task::Broker.
+//
+// The counters are always collected (they are relaxed atomic increments) and can be read at any time:
+//
+//   m_broker->metrics().print_on(std::cout);
+//
+// The run time of the tasks is recorded in a histogram with power-of-two buckets,
+// so the reported percentiles are upper bounds that are at most a factor of two too large.
+//
+class BrokerMetrics
+{
+ public:
+  using clock_type = std::chrono::steady_clock;
+
+  struct Stats
+  {
+    uint64_t m_lookups = 0;                             // The number of keys passed to run() / run_many().
+    uint64_t m_finished_hits = 0;                       // Lookups that found an entry whose task already finished.
+    uint64_t m_running_hits = 0;                        // Lookups that found an entry whose task didn't finish yet (coalesced requests).
+    uint64_t m_misses = 0;                              // Lookups that created a new entry (and task).
+    uint64_t m_tasks_finished = 0;                      // The number of tasks (including refreshes) that finished.
+    clock_type::duration m_average_run_time{};          // The average run time of the tasks that finished.
+    clock_type::duration m_p99_run_time{};              // Upper bound of the run time of 99% of the tasks that finished.
+    clock_type::duration m_max_run_time{};              // The longest run time.
+    uint64_t m_queued_callbacks = 0;                    // The number of callbacks that are currently waiting for their task.
+    // The length of the callback queue of an entry is sampled every time a callback is queued, right after adding it.
+    double m_average_queue_length = 0.0;                // The average of those samples.
+    uint64_t m_max_queue_length = 0;                    // The largest of those samples.
+    size_t m_size = 0;                                  // The current number of entries.
+
+    void print_on(std::ostream& os) const;
+  };
+
+ private:
+  // Bucket i counts run times in the range [2^i, 2^(i+1)) nanoseconds (bucket 0 also counts zero).
+  static constexpr size_t number_of_buckets = 48;
+
+  std::atomic<uint64_t> m_lookups{0};
+  std::atomic<uint64_t> m_finished_hits{0};
+  std::atomic<uint64_t> m_running_hits{0};
+  std::atomic<uint64_t> m_misses{0};
+  std::atomic<uint64_t> m_tasks_finished{0};
+  std::atomic<uint64_t> m_total_run_time_ns{0};
+  std::atomic<uint64_t> m_max_run_time_ns{0};
+  std::array<std::atomic<uint64_t>, number_of_buckets> m_run_time_histogram{};
+  std::atomic<int64_t> m_queued_callbacks{0};
+  std::atomic<uint64_t> m_queue_length_samples{0};
+  std::atomic<uint64_t> m_queue_length_sum{0};
+  std::atomic<uint64_t> m_max_queue_length{0};
+
+ public:
+  // A lookup found an entry whose task finished.
+  void finished_hit() { m_lookups.fetch_add(1, std::memory_order_relaxed); m_finished_hits.fetch_add(1, std::memory_order_relaxed); }
+  // A lookup found an entry whose task is still running.
+  void running_hit() { m_lookups.fetch_add(1, std::memory_order_relaxed); m_running_hits.fetch_add(1, std::memory_order_relaxed); }
+  // A lookup created a new entry.
+  void miss() { m_lookups.fetch_add(1, std::memory_order_relaxed); m_misses.fetch_add(1, std::memory_order_relaxed); }
+
+  // A callback was added to the queue of an entry, which is now queue_length long.
+  void callback_queued(uint64_t queue_length);
+  // Number_of_callbacks callbacks were removed from the queue of an entry.
+  void callbacks_removed(uint64_t number_of_callbacks) { m_queued_callbacks.fetch_sub(number_of_callbacks, std::memory_order_relaxed); }
+
+  // A task finished after running for run_time.
+  void task_finished(clock_type::duration run_time);
+
+  // Return a copy of the statistics collected so far; size is the current number of entries of the Broker.
+  Stats snapshot(size_t size) const;
+};
+
+} // namespace statefultask
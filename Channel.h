@@ -0,0 +1,340 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Bounded channel between tasks. Declaration of class Channel.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "AIStatefulTask.h"
+#include "AIStatefulTaskMutex.h"
+#include "threadsafe/aithreadsafe.h"
+#include <atomic>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include "debug.h"
+
+namespace statefultask {
+
+// Channel
+//
+// A bounded multi-producer multi-consumer queue between tasks.
+//
+// Usage:
+//
+//   statefultask::Channel<Foo, 64> m_channel;
+//
+// A producer task does:
+//
+//   case Producer_push:
+//     set_state(Producer_push);         // Try again when signaled.
+//     if (!m_channel.push(m_foo, this, 1))
+//     {
+//       wait(1);                        // The channel is full.
+//       break;
+//     }
+//     // m_foo was moved into the channel.
+//
+// And a consumer task:
+//
+//   case Consumer_pop:
+//     set_state(Consumer_pop);          // Try again when signaled.
+//     if (!m_channel.pop(m_foo, this, 1))
+//     {
+//       wait(1);                        // The channel is empty.
+//       break;
+//     }
+//     // m_foo contains the next element.
+//
+// The elements are stored in a lock-free ring buffer of N cells (N must be a power of two).
+// A task is only registered (and later signaled) when push or pop failed, that is, when
+// the channel was full, respectively empty. Therefore a producer and consumer that keep up
+// with each other never signal anyone: every successful push and pop still costs a sequentially
+// consistent fence (an mfence on x86) plus a load of an atomic counter, which is what guarantees
+// that a task that registers itself concurrently is not missed.
+//
+// Every successful push signals at most one registered consumer, and every successful pop at
+// most one registered producer: one per element, respectively free cell. A signaled task is no
+// longer registered; it must call push / pop again, which might fail again if another task got
+// there first (in which case it is registered again).
+//
+// A task that is aborted while it is registered (push or pop returned false and it is waiting)
+// must remove itself with cancel(this), for example from its abort_impl; otherwise the channel
+// would signal it after it was destructed.
+//
+// Registered tasks are kept in a FIFO queue whose nodes are allocated from
+// AIStatefulTaskMutex::s_node_memory_resource, so AIStatefulTaskMutex::init must have been
+// called (see DefaultMemoryPagePool).
+//
+template<typename T, size_t N>
+class Channel
+{
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "N must be a power of two.");
+
+  using condition_type = AIStatefulTask::condition_type;
+  static constexpr size_t mask = N - 1;
+  static constexpr size_t cache_line_size = 64;
+
+  struct Cell
+  {
+    std::atomic<size_t> m_sequence;
+    alignas(T) std::byte m_storage[sizeof(T)];
+
+    T* value() { return std::launder(reinterpret_cast<T*>(m_storage)); }
+  };
+
+  // Node in a singly linked list of tasks that are waiting for this channel.
+  struct Node
+  {
+    Node* m_next;
+    AIStatefulTask* m_task;
+    condition_type m_condition;
+
+    Node(AIStatefulTask* task, condition_type condition) : m_next(nullptr), m_task(task), m_condition(condition) { }
+  };
+  static_assert(sizeof(Node) <= AIStatefulTaskMutex::node_size(), "Node must fit in the blocks of AIStatefulTaskMutex::s_node_memory_resource.");
+
+  struct queue_st
+  {
+    Node* m_head = nullptr;
+    Node* m_tail = nullptr;
+  };
+  using queue_type = aithreadsafe::Wrapper<queue_st, aithreadsafe::policy::Primitive<std::mutex>>;
+
+  // The tasks that are waiting on one side of the channel.
+  struct WaitList
+  {
+    std::atomic<int> m_count{0};        // The number of nodes in m_queue; allows the other side to skip locking m_queue.
+    queue_type m_queue;
+  };
+
+  alignas(cache_line_size) std::atomic<size_t> m_enqueue_pos;
+  alignas(cache_line_size) std::atomic<size_t> m_dequeue_pos;
+  alignas(cache_line_size) std::array<Cell, N> m_cells;
+  WaitList m_producers;                 // Tasks waiting until the channel is no longer full.
+  WaitList m_consumers;                 // Tasks waiting until the channel is no longer empty.
+
+ public:
+  Channel() : m_enqueue_pos(0), m_dequeue_pos(0)
+  {
+    for (size_t i = 0; i < N; ++i)
+      m_cells[i].m_sequence.store(i, std::memory_order_relaxed);
+  }
+
+  ~Channel()
+  {
+    // Destroy the elements that were never popped.
+    for (size_t pos = m_dequeue_pos.load(std::memory_order_relaxed); pos != m_enqueue_pos.load(std::memory_order_relaxed); ++pos)
+      m_cells[pos & mask].value()->~T();
+    // Destroying a channel that tasks are still waiting on.
+    ASSERT(m_producers.m_count == 0 && m_consumers.m_count == 0);
+  }
+
+  // Remove task from the tasks that are waiting for this channel, if it is registered.
+  void cancel(AIStatefulTask* task)
+  {
+    remove_task(m_producers, task);
+    remove_task(m_consumers, task);
+  }
+
+  // Move value into the channel, if it isn't full. Returns true upon success.
+  // Upon failure value is left untouched and nobody will be signaled.
+  bool try_push(T& value)
+  {
+    if (!try_push_impl(value))
+      return false;
+    wake_one(m_consumers);
+    return true;
+  }
+
+  // Move the next element into value, if the channel isn't empty. Returns true upon success.
+  // Upon failure nobody will be signaled.
+  bool try_pop(T& value)
+  {
+    if (!try_pop_impl(value))
+      return false;
+    wake_one(m_producers);
+    return true;
+  }
+
+  // Move value into the channel. Returns true upon success.
+  // If the channel is full then value is left untouched and false is returned;
+  // task will be signaled with condition once the channel might no longer be full.
+  bool push(T& value, AIStatefulTask* task, condition_type condition)
+  {
+    if (try_push_impl(value))
+    {
+      wake_one(m_consumers);
+      return true;
+    }
+    if (register_task(m_producers, task, condition, [&](){ return try_push_impl(value); }))
+    {
+      wake_one(m_consumers);
+      return true;
+    }
+    return false;       // The caller must call task->wait(condition).
+  }
+
+  // Move the next element into value. Returns true upon success.
+  // If the channel is empty then false is returned;
+  // task will be signaled with condition once the channel might no longer be empty.
+  bool pop(T& value, AIStatefulTask* task, condition_type condition)
+  {
+    if (try_pop_impl(value))
+    {
+      wake_one(m_producers);
+      return true;
+    }
+    if (register_task(m_consumers, task, condition, [&](){ return try_pop_impl(value); }))
+    {
+      wake_one(m_producers);
+      return true;
+    }
+    return false;       // The caller must call task->wait(condition).
+  }
+
+ private:
+  bool try_push_impl(T& value)
+  {
+    Cell* cell;
+    size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    for (;;)
+    {
+      cell = &m_cells[pos & mask];
+      size_t seq = cell->m_sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0)
+      {
+        if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      }
+      else if (diff < 0)
+        return false;   // Full.
+      else
+        pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    }
+    new (cell->m_storage) T(std::move(value));
+    cell->m_sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool try_pop_impl(T& value)
+  {
+    Cell* cell;
+    size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    for (;;)
+    {
+      cell = &m_cells[pos & mask];
+      size_t seq = cell->m_sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0)
+      {
+        if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      }
+      else if (diff < 0)
+        return false;   // Empty.
+      else
+        pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    }
+    T* element = cell->value();
+    value = std::move(*element);
+    element->~T();
+    cell->m_sequence.store(pos + mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Register task in wait_list, unless retry() succeeds after incrementing m_count.
+  // Returns true if retry() succeeded (and task was not registered).
+  template<typename Retry>
+  bool register_task(WaitList& wait_list, AIStatefulTask* task, condition_type condition, Retry retry)
+  {
+    typename queue_type::wat queue_w(wait_list.m_queue);
+    // Announce that we are about to wait before trying again: either we see the element (or free cell)
+    // that was added by the other side, or the other side sees m_count > 0 (see wake_one).
+    wait_list.m_count.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (retry())
+    {
+      wait_list.m_count.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+    Node* new_node = new (AIStatefulTaskMutex::s_node_memory_resource.allocate(sizeof(Node))) Node(task, condition);
+    if (queue_w->m_head)
+      queue_w->m_tail->m_next = new_node;
+    else
+      queue_w->m_head = new_node;
+    queue_w->m_tail = new_node;
+    return false;
+  }
+
+  // Remove the node of task from wait_list, if any.
+  void remove_task(WaitList& wait_list, AIStatefulTask* task)
+  {
+    typename queue_type::wat queue_w(wait_list.m_queue);
+    Node* prev = nullptr;
+    for (Node* node = queue_w->m_head; node; prev = node, node = node->m_next)
+    {
+      if (node->m_task != task)
+        continue;
+      if (prev)
+        prev->m_next = node->m_next;
+      else
+        queue_w->m_head = node->m_next;
+      if (queue_w->m_tail == node)
+        queue_w->m_tail = prev;
+      wait_list.m_count.fetch_sub(1, std::memory_order_relaxed);
+      AIStatefulTaskMutex::s_node_memory_resource.deallocate(node);
+      return;
+    }
+  }
+
+  // Signal the first task in wait_list, if any.
+  void wake_one(WaitList& wait_list)
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (AI_LIKELY(wait_list.m_count.load(std::memory_order_relaxed) == 0))
+      return;
+    Node* node;
+    {
+      typename queue_type::wat queue_w(wait_list.m_queue);
+      node = queue_w->m_head;
+      // The task that incremented m_count succeeded on its retry (register_task holds the lock throughout).
+      if (!node)
+        return;
+      queue_w->m_head = node->m_next;
+      wait_list.m_count.fetch_sub(1, std::memory_order_relaxed);
+    }
+    AIStatefulTask* task = node->m_task;
+    condition_type condition = node->m_condition;
+    AIStatefulTaskMutex::s_node_memory_resource.deallocate(node);
+    // Call signal() without holding the lock on m_queue, because it could cause the task to run immediately.
+    task->signal(condition);
+  }
+};
+
+} // namespace statefultask
@@ -0,0 +1,153 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Single-use countdown for tasks. Declaration of class Latch.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "AIStatefulTask.h"
+#include <atomic>
+#include <cstdint>
+#include "debug.h"
+
+namespace statefultask {
+
+// A registration of a task that waits for a Latch or Barrier.
+//
+// The waiting task provides this object (normally as a member), so that
+// registering never allocates memory. A TaskWaiter can only be registered
+// with one Latch or Barrier at a time; it can be reused after the task was
+// signaled.
+struct TaskWaiter
+{
+  TaskWaiter* m_next = nullptr;
+  AIStatefulTask* m_task = nullptr;
+  AIStatefulTask::condition_type m_condition = 0;
+};
+
+namespace detail {
+
+// Signal all tasks in the (intrusive) list of waiters.
+inline void signal_waiters(TaskWaiter* list, TaskWaiter const* except = nullptr)
+{
+  while (list)
+  {
+    // Read everything before calling signal(), the task might reuse its TaskWaiter immediately.
+    TaskWaiter* waiter = list;
+    list = waiter->m_next;
+    if (waiter != except)
+      waiter->m_task->signal(waiter->m_condition);
+  }
+}
+
+} // namespace detail
+
+// Latch
+//
+// A single-use count down: tasks that wait on the latch are released
+// when the counter reaches zero.
+//
+// Usage:
+//
+//   statefultask::Latch m_ready{3};
+//
+// Each of three tasks calls m_ready.count_down() when it did its part,
+// while tasks that need to wait for them do:
+//
+//   case WaitForReady:
+//     set_state(Ready);
+//     if (!m_ready.wait(m_ready_waiter, this, 1))       // m_ready_waiter is a TaskWaiter member.
+//     {
+//       wait(1);
+//       break;
+//     }
+//     [[fallthrough]];
+//   case Ready:
+//
+// count_down is a single atomic decrement; the thread that makes the
+// counter reach zero signals all waiting tasks in one go.
+//
+class Latch
+{
+ private:
+  std::atomic<uint32_t> m_count;
+  std::atomic<TaskWaiter*> m_waiters;   // Intrusive stack of waiting tasks, or released_marker() once the counter reached zero.
+
+  static TaskWaiter* released_marker() { return reinterpret_cast<TaskWaiter*>(uintptr_t{1}); }
+
+ public:
+  explicit Latch(uint32_t count) : m_count(count), m_waiters(count == 0 ? released_marker() : nullptr) { }
+
+  ~Latch()
+  {
+    // Destroying a latch that tasks are still waiting on.
+    ASSERT(m_waiters == nullptr || m_waiters == released_marker());
+  }
+
+  // Decrement the counter by n; release the waiting tasks when it reaches zero.
+  void count_down(uint32_t n = 1)
+  {
+    uint32_t previous_count = m_count.fetch_sub(n, std::memory_order_acq_rel);
+    // Don't count down more often than the initial count.
+    ASSERT(previous_count >= n);
+    if (previous_count == n)
+    {
+      Dout(dc::notice, "Latch " << this << " released.");
+      detail::signal_waiters(m_waiters.exchange(released_marker(), std::memory_order_acq_rel));
+    }
+  }
+
+  // Returns true if the counter reached zero.
+  bool try_wait() const
+  {
+    return m_count.load(std::memory_order_acquire) == 0;
+  }
+
+  // Returns true if the counter already reached zero. Otherwise task is registered
+  // (using waiter) and will be signaled with condition once it does.
+  bool wait(TaskWaiter& waiter, AIStatefulTask* task, AIStatefulTask::condition_type condition)
+  {
+    waiter.m_task = task;
+    waiter.m_condition = condition;
+    TaskWaiter* head = m_waiters.load(std::memory_order_acquire);
+    do
+    {
+      if (head == released_marker())
+        return true;
+      waiter.m_next = head;
+    }
+    while (!m_waiters.compare_exchange_weak(head, &waiter, std::memory_order_acq_rel, std::memory_order_acquire));
+    return false;       // The caller must call task->wait(condition).
+  }
+
+  // Count down by one and wait.
+  bool arrive_and_wait(TaskWaiter& waiter, AIStatefulTask* task, AIStatefulTask::condition_type condition)
+  {
+    count_down();
+    return wait(waiter, task, condition);
+  }
+};
+
+} // namespace statefultask
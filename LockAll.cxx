@@ -0,0 +1,79 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Implementation of LockAll.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "LockAll.h"
+#include "AIStatefulTask.h"
+
+namespace statefultask {
+
+bool MutexGroupBase::lock(AIStatefulTask* task, condition_type condition)
+{
+  DoutEntering(dc::notice, "MutexGroupBase::lock(" << task << ", " << task->print_conditions(condition) << ") [" << this << "]");
+  // Don't call lock() twice without unlock().
+  ASSERT(m_locked == 0);
+  m_task = task;
+  m_condition = condition;
+  m_priority = AIStatefulTaskMutex::task_priority(task);
+  return lock_remaining();
+}
+
+bool MutexGroupBase::lock_remaining()
+{
+  while (m_locked < m_size)
+  {
+    // Once lock() returns nullptr, granted() can be called by another thread at any moment:
+    // don't touch any member after that.
+    if (!m_mutexes[m_locked]->lock(m_task, m_condition, this, m_priority))
+      return false;
+    ++m_locked;
+  }
+  return true;
+}
+
+void MutexGroupBase::granted()
+{
+  // We now own m_mutexes[m_locked].
+  ++m_locked;
+  // Continue locking the remaining mutexes on behalf of m_task.
+  if (lock_remaining())
+  {
+    Dout(dc::notice, "All " << m_size << " mutexes of group " << this << " are now held by " << m_task);
+    m_task->signal(m_condition);
+  }
+}
+
+void MutexGroupBase::unlock()
+{
+  DoutEntering(dc::notice, "MutexGroupBase::unlock() [" << this << "]");
+  // Only call unlock() after lock() returned true, or after the task was signaled.
+  ASSERT(m_locked == m_size);
+  while (m_locked > 0)
+    m_mutexes[--m_locked]->unlock();
+}
+
+} // namespace statefultask
@@ -0,0 +1,132 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Lock several task mutexes at once. Declaration of class LockAll.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "AIStatefulTaskMutex.h"
+#include "debug.h"
+#include <array>
+#include <algorithm>
+#include <functional>
+#include <cstdint>
+
+class AIStatefulTask;
+
+namespace statefultask {
+
+// Acquire several AIStatefulTaskMutex's at once.
+//
+// Usage:
+//
+//   class MyTask : public AIStatefulTask
+//   {
+//     statefultask::LockAll<2> m_locks;
+//    public:
+//     MyTask(...) : ..., m_locks(mutex1, mutex2) { }
+//   ...
+//     case MyTask_lock:
+//       set_state(MyTask_locked);
+//       if (!m_locks.lock(this, 1))
+//       {
+//         wait(1);
+//         break;
+//       }
+//       [[fallthrough]];
+//     case MyTask_locked:
+//       do_work();
+//       m_locks.unlock();
+//
+// The mutexes are always locked in the same (canonical) order, that of their address,
+// so that tasks that use LockAll on overlapping sets of mutexes can't deadlock.
+//
+// If one of the mutexes is held by another task then lock() returns false and the
+// task must call wait(condition). The remaining mutexes are then acquired on behalf
+// of the task by the thread(s) that unlock them, and the task is signaled only once:
+// when it holds all of them.
+//
+class MutexGroupBase
+{
+  using condition_type = uint32_t;      // Must be the same as AIStatefulTask::condition_type
+
+ private:
+  AIStatefulTaskMutex* const* m_mutexes;        // Points to the sorted array of mutexes in LockAll.
+  size_t const m_size;                          // The number of mutexes.
+  size_t m_locked;                              // The number of mutexes (at the start of m_mutexes) that are held.
+  AIStatefulTask* m_task;                       // The task that is locking this group.
+  condition_type m_condition;                   // The condition to signal m_task with once it holds all mutexes.
+  size_t m_priority;                            // The priority of m_task, read by lock() because granted() runs in another thread.
+
+ protected:
+  MutexGroupBase(size_t size) : m_mutexes(nullptr), m_size(size), m_locked(0), m_task(nullptr), m_condition(0), m_priority(AIStatefulTaskMutexNode::no_priority) { }
+  void set_mutexes(AIStatefulTaskMutex* const* mutexes) { m_mutexes = mutexes; }
+
+ public:
+  // Try to lock all mutexes for task.
+  //
+  // Returns true when all mutexes are locked. Otherwise the task will be signaled
+  // with condition once it holds all of them, and the caller must call task->wait(condition).
+  bool lock(AIStatefulTask* task, condition_type condition);
+
+  // Unlock all mutexes.
+  void unlock();
+
+ private:
+  friend class ::AIStatefulTaskMutex;
+  // Lock m_mutexes[m_locked] and beyond, in order. Returns true if they are all locked.
+  bool lock_remaining();
+  // Called by AIStatefulTaskMutex::unlock when the mutex that this group was waiting for was passed to it.
+  void granted();
+};
+
+template<size_t N>
+class LockAll : public MutexGroupBase
+{
+  static_assert(N > 0, "LockAll requires at least one mutex.");
+
+ private:
+  std::array<AIStatefulTaskMutex*, N> m_sorted_mutexes;
+
+ public:
+  template<typename... Mutexes>
+  LockAll(Mutexes&... mutexes) : MutexGroupBase(N), m_sorted_mutexes{{&mutexes...}}
+  {
+    static_assert(sizeof...(Mutexes) == N, "The number of mutexes passed must be equal to N.");
+    std::sort(m_sorted_mutexes.begin(), m_sorted_mutexes.end(), std::less<AIStatefulTaskMutex*>{});
+    // Each mutex may only occur once.
+    ASSERT(std::adjacent_find(m_sorted_mutexes.begin(), m_sorted_mutexes.end()) == m_sorted_mutexes.end());
+    set_mutexes(m_sorted_mutexes.data());
+  }
+
+  // Not copyable or movable: the mutexes might keep a pointer to us.
+  LockAll(LockAll const&) = delete;
+  LockAll& operator=(LockAll const&) = delete;
+};
+
+template<typename... Mutexes>
+LockAll(Mutexes&...) -> LockAll<sizeof...(Mutexes)>;
+
+} // namespace statefultask
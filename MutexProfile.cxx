@@ -0,0 +1,199 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Implementation of MutexProfile.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "MutexProfile.h"
+#include "threadsafe/aithreadsafe.h"
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+namespace statefultask {
+
+namespace {
+
+using registry_type = aithreadsafe::Wrapper<std::vector<MutexProfile const*>, aithreadsafe::policy::Primitive<std::mutex>>;
+
+registry_type& registry()
+{
+  static registry_type s_registry;
+  return s_registry;
+}
+
+// Atomically replace max by value if that is larger.
+template<typename T>
+void update_max(std::atomic<T>& max, T value)
+{
+  T current = max.load(std::memory_order_relaxed);
+  while (current < value && !max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+    ;
+}
+
+} // namespace
+
+MutexProfile::MutexProfile(std::string name) : m_name(std::move(name)), m_waiting(0), m_owner_name(nullptr)
+{
+  registry_type::wat(registry())->push_back(this);
+}
+
+MutexProfile::~MutexProfile()
+{
+  registry_type::wat registry_w(registry());
+  registry_w->erase(std::find(registry_w->begin(), registry_w->end(), this));
+}
+
+MutexProfile::Counters& MutexProfile::counters(char const* task_name)
+{
+  // Open addressing on the address of the string literal; a slot is claimed by the first task name that needs it and never released.
+  size_t const start = (reinterpret_cast<uintptr_t>(task_name) / alignof(std::max_align_t)) % max_task_names;
+  for (size_t i = 0; i < max_task_names; ++i)
+  {
+    Counters& slot = m_counters[(start + i) % max_task_names];
+    char const* name = slot.m_task_name.load(std::memory_order_acquire);
+    // Claim a free slot. If another task name claimed it in the meantime, then name is set to that task name.
+    if (!name && slot.m_task_name.compare_exchange_strong(name, task_name, std::memory_order_acq_rel))
+      return slot;
+    if (name == task_name)
+      return slot;
+  }
+  return m_counters[max_task_names];
+}
+
+void MutexProfile::acquired(char const* task_name, clock_type::time_point now)
+{
+  counters(task_name).m_acquisitions.fetch_add(1, std::memory_order_relaxed);
+  m_owner_name = task_name;
+  m_locked_at = now;
+}
+
+void MutexProfile::acquired_after_wait(char const* task_name, clock_type::time_point enqueued, clock_type::time_point now)
+{
+  m_waiting.fetch_sub(1, std::memory_order_relaxed);
+  clock_type::rep const wait_time = (now - enqueued).count();
+  Counters& stats = counters(task_name);
+  stats.m_acquisitions.fetch_add(1, std::memory_order_relaxed);
+  stats.m_contended_acquisitions.fetch_add(1, std::memory_order_relaxed);
+  stats.m_wait_time.fetch_add(wait_time, std::memory_order_relaxed);
+  update_max(stats.m_max_wait_time, wait_time);
+  m_owner_name = task_name;
+  m_locked_at = now;
+}
+
+void MutexProfile::queued(char const* task_name)
+{
+  uint64_t const queue_depth = m_waiting.fetch_add(1, std::memory_order_relaxed) + 1;
+  Counters& stats = counters(task_name);
+  stats.m_queue_depth_sum.fetch_add(queue_depth, std::memory_order_relaxed);
+  update_max(stats.m_max_queue_depth, queue_depth);
+}
+
+void MutexProfile::released(clock_type::time_point now)
+{
+  // Only the owner calls released().
+  ASSERT(m_owner_name);
+  Counters& stats = counters(m_owner_name);
+  clock_type::rep const hold_time = (now - m_locked_at).count();
+  stats.m_hold_time.fetch_add(hold_time, std::memory_order_relaxed);
+  update_max(stats.m_max_hold_time, hold_time);
+  m_owner_name = nullptr;
+}
+
+MutexProfile::Stats MutexProfile::Counters::load() const
+{
+  Stats stats;
+  stats.m_acquisitions = m_acquisitions.load(std::memory_order_relaxed);
+  stats.m_contended_acquisitions = m_contended_acquisitions.load(std::memory_order_relaxed);
+  stats.m_queue_depth_sum = m_queue_depth_sum.load(std::memory_order_relaxed);
+  stats.m_max_queue_depth = m_max_queue_depth.load(std::memory_order_relaxed);
+  stats.m_hold_time = clock_type::duration{m_hold_time.load(std::memory_order_relaxed)};
+  stats.m_max_hold_time = clock_type::duration{m_max_hold_time.load(std::memory_order_relaxed)};
+  stats.m_wait_time = clock_type::duration{m_wait_time.load(std::memory_order_relaxed)};
+  stats.m_max_wait_time = clock_type::duration{m_max_wait_time.load(std::memory_order_relaxed)};
+  return stats;
+}
+
+std::map<std::string, MutexProfile::Stats> MutexProfile::snapshot() const
+{
+  // The counters are read one by one while they might be changing: the result is not necessarily consistent.
+  std::map<std::string, Stats> result;
+  for (size_t i = 0; i < max_task_names; ++i)
+    if (char const* task_name = m_counters[i].m_task_name.load(std::memory_order_acquire))
+      result[task_name] += m_counters[i].load();        // Different task types can have the same name.
+  Stats const other = m_counters[max_task_names].load();
+  if (other.m_acquisitions || other.m_queue_depth_sum)
+    result["(other)"] += other;
+  return result;
+}
+
+MutexProfile::Stats& MutexProfile::Stats::operator+=(Stats const& stats)
+{
+  m_acquisitions += stats.m_acquisitions;
+  m_contended_acquisitions += stats.m_contended_acquisitions;
+  m_queue_depth_sum += stats.m_queue_depth_sum;
+  m_max_queue_depth = std::max(m_max_queue_depth, stats.m_max_queue_depth);
+  m_hold_time += stats.m_hold_time;
+  m_max_hold_time = std::max(m_max_hold_time, stats.m_max_hold_time);
+  m_wait_time += stats.m_wait_time;
+  m_max_wait_time = std::max(m_max_wait_time, stats.m_max_wait_time);
+  return *this;
+}
+
+void MutexProfile::Stats::print_on(std::ostream& os) const
+{
+  using std::chrono::duration_cast;
+  using std::chrono::microseconds;
+  os << "acquisitions:" << m_acquisitions <<
+      ", contended:" << m_contended_acquisitions <<
+      ", average queue depth:" << (m_acquisitions ? static_cast<double>(m_queue_depth_sum) / m_acquisitions : 0.0) <<
+      ", max queue depth:" << m_max_queue_depth <<
+      ", hold time:" << duration_cast<microseconds>(m_hold_time).count() << " us" <<
+      " (max " << duration_cast<microseconds>(m_max_hold_time).count() << " us)" <<
+      ", wait time:" << duration_cast<microseconds>(m_wait_time).count() << " us" <<
+      " (max " << duration_cast<microseconds>(m_max_wait_time).count() << " us)";
+}
+
+void MutexProfile::print_on(std::ostream& os) const
+{
+  os << "Mutex \"" << m_name << "\":\n";
+  for (auto const& [task_name, stats] : snapshot())
+  {
+    os << "  " << task_name << ": ";
+    stats.print_on(os);
+    os << '\n';
+  }
+}
+
+//static
+void MutexProfile::print_all(std::ostream& os)
+{
+  registry_type::crat registry_r(registry());
+  for (MutexProfile const* profile : *registry_r)
+    profile->print_on(os);
+}
+
+} // namespace statefultask
@@ -0,0 +1,136 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Contention statistics of task mutexes. Declaration of class MutexProfile.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <string>
+#include "debug.h"
+
+class AIStatefulTaskMutex;
+
+namespace statefultask {
+
+// Contention statistics of one AIStatefulTaskMutex, per task type (task_name()) of the tasks that lock it.
+//
+// Profiling is enabled per mutex, before it is used, with
+//
+//   m_mutex.enable_profiling("cache mutex");
+//
+// A mutex for which profiling isn't enabled only pays for a test of a null pointer.
+// The collected statistics can be read at any time with snapshot(), or printed
+// (for all profiled mutexes) with MutexProfile::print_all(std::cout).
+//
+// Recording doesn't take a lock and doesn't allocate memory: the statistics are kept in
+// relaxed atomic counters, in a fixed number of slots per task name (task names beyond
+// max_task_names are counted together under "(other)"), and the time at which a task
+// was queued is stored in its queue node.
+//
+class MutexProfile
+{
+ public:
+  using clock_type = std::chrono::steady_clock;
+
+  struct Stats
+  {
+    uint64_t m_acquisitions = 0;                        // The number of times the mutex was obtained.
+    uint64_t m_contended_acquisitions = 0;              // The number of times the mutex was obtained after waiting for it.
+    uint64_t m_queue_depth_sum = 0;                     // The sum of the number of waiting tasks seen by each call to lock().
+    uint64_t m_max_queue_depth = 0;                     // The largest number of waiting tasks seen by a call to lock().
+    clock_type::duration m_hold_time{};                 // The total time that the mutex was held.
+    clock_type::duration m_max_hold_time{};             // The longest time that the mutex was held.
+    clock_type::duration m_wait_time{};                 // The total time between queuing and being granted the mutex.
+    clock_type::duration m_max_wait_time{};             // The longest time between queuing and being granted the mutex.
+
+    Stats& operator+=(Stats const& stats);
+    void print_on(std::ostream& os) const;
+  };
+
+ public:
+  static constexpr size_t max_task_names = 16;          // The number of different task names that are counted separately.
+
+ private:
+  // The statistics of one task name.
+  struct Counters
+  {
+    std::atomic<char const*> m_task_name{nullptr};      // The task_name() (a string literal) that this slot is used for, or nullptr when it is still free.
+    std::atomic<uint64_t> m_acquisitions{0};
+    std::atomic<uint64_t> m_contended_acquisitions{0};
+    std::atomic<uint64_t> m_queue_depth_sum{0};
+    std::atomic<uint64_t> m_max_queue_depth{0};
+    std::atomic<clock_type::rep> m_hold_time{0};
+    std::atomic<clock_type::rep> m_max_hold_time{0};
+    std::atomic<clock_type::rep> m_wait_time{0};
+    std::atomic<clock_type::rep> m_max_wait_time{0};
+
+    Stats load() const;
+  };
+
+  std::string const m_name;
+  std::atomic<uint64_t> m_waiting;                      // The number of tasks that are queued.
+  std::array<Counters, max_task_names + 1> m_counters;  // The statistics per task name; the last slot is used when all others are taken.
+
+  // Only accessed by the owner of the mutex (and by the task that passes the mutex on), so the mutex itself protects these.
+  char const* m_owner_name;                             // The task_name() of the current owner.
+  clock_type::time_point m_locked_at;                   // The time at which the current owner obtained the mutex.
+
+ public:
+  MutexProfile(std::string name);
+  ~MutexProfile();
+
+  std::string const& name() const { return m_name; }
+
+  // Return a copy of the statistics collected so far, per task name.
+  std::map<std::string, Stats> snapshot() const;
+
+  // Print the statistics of this mutex.
+  void print_on(std::ostream& os) const;
+
+  // Print the statistics of all mutexes that have profiling enabled.
+  static void print_all(std::ostream& os);
+
+ private:
+  friend class ::AIStatefulTaskMutex;
+  // A task with name task_name obtained the mutex without waiting.
+  void acquired(char const* task_name, clock_type::time_point now);
+  // A task with name task_name, that was queued at enqueued, obtained the mutex.
+  void acquired_after_wait(char const* task_name, clock_type::time_point enqueued, clock_type::time_point now);
+  // A task with name task_name is being queued.
+  void queued(char const* task_name);
+  // The owner released the mutex.
+  void released(clock_type::time_point now);
+
+  // Return the slot of task_name.
+  Counters& counters(char const* task_name);
+};
+
+} // namespace statefultask
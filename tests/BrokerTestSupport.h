@@ -0,0 +1,132 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Helpers shared by the behavioral tests of task::Broker.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "TestSupport.h"
+#include "statefultask/Broker.h"
+#include <algorithm>
+#include <vector>
+
+// Calculate the square of an integer.
+//
+// While s_gated is set, the tasks wait (in s_waiting) until main signals them.
+class Square : public AIStatefulTask
+{
+ protected:
+  using direct_base_type = AIStatefulTask;
+
+  enum square_state_type {
+    Square_start = direct_base_type::state_end,
+    Square_done
+  };
+
+ public:
+  static constexpr state_type state_end = Square_done + 1;
+
+  static inline int s_created = 0;              // The number of tasks that were created.
+  static inline int s_running = 0;              // The number of tasks that are running.
+  static inline int s_max_running = 0;          // The largest value of s_running so far.
+  static inline bool s_gated = false;
+  static inline std::vector<Square*> s_waiting;
+  static inline int s_offset = 0;               // Added to the result, to tell a recalculated result apart.
+
+ private:
+  int m_n;
+  int m_result;
+
+ public:
+  Square(CWDEBUG_ONLY(bool debug)) : AIStatefulTask(CWDEBUG_ONLY(debug)), m_n(0), m_result(0) { ++s_created; }
+
+  void set_n(int n) { m_n = n; }
+  int result() const { return m_result; }
+
+ protected:
+  ~Square() override = default;
+
+  char const* state_str_impl(state_type run_state) const override
+  {
+    switch (run_state)
+    {
+      AI_CASE_RETURN(Square_start);
+      AI_CASE_RETURN(Square_done);
+    }
+    AI_NEVER_REACHED;
+  }
+
+  char const* task_name_impl() const override { return "Square"; }
+
+  void multiplex_impl(state_type run_state) override
+  {
+    switch (run_state)
+    {
+      case Square_start:
+        s_max_running = std::max(s_max_running, ++s_running);
+        set_state(Square_done);
+        if (s_gated)
+        {
+          s_waiting.push_back(this);
+          wait(1);
+          break;
+        }
+        [[fallthrough]];
+      case Square_done:
+        --s_running;
+        m_result = m_n * m_n + s_offset;
+        finish();
+        break;
+    }
+  }
+};
+
+struct IntKey
+{
+  int m_n;
+
+  uint64_t hash() const { return static_cast<uint64_t>(m_n) * 0x9e3779b97f4a7c15ULL; }
+  bool operator==(IntKey const& other) const { return m_n == other.m_n; }
+  void initialize(boost::intrusive_ptr<Square> const& task) const { task->set_n(m_n); }
+  void print_on(std::ostream& os) const { os << "IntKey:" << m_n; }
+};
+
+using broker_type = task::Broker<Square, statefultask::TypedBrokerKey<IntKey>>;
+
+// Let all tasks that are waiting in s_waiting finish, one at a time.
+inline void release_one()
+{
+  TEST_CHECK(!Square::s_waiting.empty());
+  Square* task = Square::s_waiting.front();
+  Square::s_waiting.erase(Square::s_waiting.begin());
+  task->signal(1);
+}
+
+// Stop the broker and run the engine until it finished.
+inline void stop(AIEngine& engine, boost::intrusive_ptr<broker_type> const& broker)
+{
+  broker->abort();
+  run_until(engine, [&](){ return broker->finished(); });
+}
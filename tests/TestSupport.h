@@ -0,0 +1,139 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Helpers shared by the behavioral tests.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "statefultask/AIEngine.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include "debug.h"
+
+// Fail the test when condition doesn't hold (also in builds where ASSERT is a no-op).
+#define TEST_CHECK(condition) \
+  do { if (!(condition)) { std::cerr << __FILE__ << ':' << __LINE__ << ": check failed: " #condition << std::endl; std::abort(); } } while (0)
+
+// Call the main loop of engine until done() returns true. Fails the test when that takes longer than timeout.
+inline void run_until(AIEngine& engine, std::function<bool()> const& done, std::chrono::seconds timeout = std::chrono::seconds(10))
+{
+  auto const deadline = std::chrono::steady_clock::now() + timeout;
+  while (!done())
+  {
+    engine.mainloop();
+    TEST_CHECK(std::chrono::steady_clock::now() < deadline);
+  }
+}
+
+// Run the main loop of engine until it has nothing left to do.
+inline void run_idle(AIEngine& engine)
+{
+  while (engine.mainloop().is_true())
+    ;
+}
+
+// A task that obtains a lock, holds it until release() is called and then unlocks it and finishes.
+//
+// The lock is obtained by calling lock(this, condition), which must return true upon success,
+// or false when the task will be signaled with condition once it obtained the lock.
+class LockTask : public AIStatefulTask
+{
+ public:
+  using lock_type = std::function<bool(AIStatefulTask*, condition_type)>;
+  using unlock_type = std::function<void()>;
+
+ protected:
+  using direct_base_type = AIStatefulTask;
+
+  enum lock_task_state_type {
+    LockTask_lock = direct_base_type::state_end,
+    LockTask_locked,
+    LockTask_unlock
+  };
+
+ public:
+  static constexpr state_type state_end = LockTask_unlock + 1;
+
+ private:
+  static constexpr condition_type lock_condition = 1;
+  static constexpr condition_type release_condition = 2;
+
+  lock_type m_lock;
+  unlock_type m_unlock;
+  std::atomic<bool> m_locked;
+
+ public:
+  LockTask(lock_type lock, unlock_type unlock) : AIStatefulTask(CWDEBUG_ONLY(false)), m_lock(std::move(lock)), m_unlock(std::move(unlock)), m_locked(false) { }
+
+  // Returns true while the task holds the lock.
+  bool locked() const { return m_locked; }
+
+  // Let the task unlock and finish.
+  void release() { signal(release_condition); }
+
+ protected:
+  ~LockTask() override = default;
+
+  char const* state_str_impl(state_type run_state) const override
+  {
+    switch (run_state)
+    {
+      AI_CASE_RETURN(LockTask_lock);
+      AI_CASE_RETURN(LockTask_locked);
+      AI_CASE_RETURN(LockTask_unlock);
+    }
+    AI_NEVER_REACHED;
+  }
+
+  char const* task_name_impl() const override { return "LockTask"; }
+
+  void multiplex_impl(state_type run_state) override
+  {
+    switch (run_state)
+    {
+      case LockTask_lock:
+        set_state(LockTask_locked);
+        if (!m_lock(this, lock_condition))
+        {
+          wait(lock_condition);
+          break;
+        }
+        [[fallthrough]];
+      case LockTask_locked:
+        m_locked = true;
+        set_state(LockTask_unlock);
+        wait(release_condition);
+        break;
+      case LockTask_unlock:
+        m_locked = false;
+        m_unlock();
+        finish();
+        break;
+    }
+  }
+};
@@ -0,0 +1,86 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Behavioral test of concurrent requests for the same key of a task::Broker.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "BrokerTestSupport.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+#include <array>
+#include <atomic>
+#include <thread>
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIMemoryPagePool mpp;
+  AIThreadPool thread_pool;
+  [[maybe_unused]] AIQueueHandle queue_handle = thread_pool.new_queue(8);
+  AIEngine engine("broker engine");
+
+  // Threads that request the same (new) key at the same time share one task.
+  {
+    auto broker = statefultask::create<broker_type>(CWDEBUG_ONLY(false));
+    broker->run(&engine);
+    Square::s_created = 0;
+    constexpr int number_of_threads = 8;
+    constexpr int requests_per_thread = 100;
+    std::atomic<bool> go{false};
+    std::atomic<int> called{0};
+    std::array<boost::intrusive_ptr<Square const>, number_of_threads> first_task;
+    std::array<bool, number_of_threads> same_task;
+    std::array<std::thread, number_of_threads> threads;
+    for (int t = 0; t < number_of_threads; ++t)
+      threads[t] = std::thread([&, t](){
+        while (!go.load(std::memory_order_acquire))
+          ;
+        same_task[t] = true;
+        for (int r = 0; r < requests_per_thread; ++r)
+        {
+          auto task = broker->run(IntKey{7}, [&](bool success){ TEST_CHECK(success); called.fetch_add(1, std::memory_order_relaxed); });
+          if (r == 0)
+            first_task[t] = std::move(task);
+          else if (task != first_task[t])
+            same_task[t] = false;
+        }
+      });
+    go.store(true, std::memory_order_release);
+    for (std::thread& thread : threads)
+      thread.join();
+    run_until(engine, [&](){ return called.load(std::memory_order_relaxed) == number_of_threads * requests_per_thread; });
+    run_idle(engine);
+    TEST_CHECK(Square::s_created == 1);
+    for (int t = 0; t < number_of_threads; ++t)
+      TEST_CHECK(same_task[t] && first_task[t] == first_task[0]);
+    TEST_CHECK(first_task[0]->result() == 49);
+    statefultask::BrokerMetrics::Stats stats = broker->metrics();
+    TEST_CHECK(stats.m_lookups == number_of_threads * requests_per_thread && stats.m_misses == 1);
+    TEST_CHECK(stats.m_finished_hits + stats.m_running_hits == stats.m_lookups - 1);
+    TEST_CHECK(stats.m_size == 1);
+    stop(engine, broker);
+  }
+}
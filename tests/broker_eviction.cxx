@@ -0,0 +1,72 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Behavioral test of the eviction of task::Broker entries.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "BrokerTestSupport.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+#include <chrono>
+#include <thread>
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIMemoryPagePool mpp;
+  AIThreadPool thread_pool;
+  [[maybe_unused]] AIQueueHandle queue_handle = thread_pool.new_queue(8);
+  AIEngine engine("broker engine");
+
+  // Entries that weren't used for time_to_live are evicted, after which the task has to run again.
+  {
+    auto broker = statefultask::create<broker_type>(CWDEBUG_ONLY(false));
+    broker->set_time_to_live(std::chrono::milliseconds(50));
+    broker->run(&engine);
+    bool done = false;
+    {
+      auto task = broker->run(IntKey{5}, [&](bool){ done = true; });
+      run_until(engine, [&](){ return done; });
+      TEST_CHECK(task->result() == 25);
+    }
+    run_idle(engine);
+    TEST_CHECK(broker->metrics().m_size == 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    // The next request wakes up the Broker, which then evicts the expired entry.
+    done = false;
+    broker->run(IntKey{6}, [&](bool){ done = true; });
+    run_until(engine, [&](){ return done; });
+    run_idle(engine);
+    TEST_CHECK(broker->metrics().m_size == 1);
+    // The evicted key is a miss again.
+    uint64_t const misses = broker->metrics().m_misses;
+    done = false;
+    broker->run(IntKey{5}, [&](bool){ done = true; });
+    run_until(engine, [&](){ return done; });
+    TEST_CHECK(broker->metrics().m_misses == misses + 1);
+    stop(engine, broker);
+  }
+}
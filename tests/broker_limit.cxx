@@ -0,0 +1,67 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Behavioral test of the concurrency limit of task::Broker.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "BrokerTestSupport.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+#include <vector>
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIMemoryPagePool mpp;
+  AIThreadPool thread_pool;
+  [[maybe_unused]] AIQueueHandle queue_handle = thread_pool.new_queue(8);
+  AIEngine engine("broker engine");
+
+  // set_max_running(1) runs the tasks one at a time, in the order in which they were requested.
+  {
+    auto broker = statefultask::create<broker_type>(CWDEBUG_ONLY(false));
+    broker->set_max_running(1);
+    broker->run(&engine);
+    Square::s_gated = true;
+    Square::s_running = Square::s_max_running = 0;
+    std::vector<int> finished;
+    std::vector<boost::intrusive_ptr<Square const>> tasks;
+    for (int n = 10; n < 13; ++n)
+      tasks.push_back(broker->run(IntKey{n}, [&finished, n](bool success){ TEST_CHECK(success); finished.push_back(n); }));
+    for (int n = 10; n < 13; ++n)
+    {
+      run_until(engine, [&](){ return !Square::s_waiting.empty(); });
+      run_idle(engine);
+      TEST_CHECK(Square::s_waiting.size() == 1 && Square::s_running == 1);
+      release_one();
+      run_until(engine, [&](){ return finished.size() == static_cast<size_t>(n - 9); });
+      TEST_CHECK(finished.back() == n);
+    }
+    TEST_CHECK(Square::s_max_running == 1);
+    Square::s_gated = false;
+    stop(engine, broker);
+  }
+}
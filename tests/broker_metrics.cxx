@@ -0,0 +1,81 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Behavioral test of the usage statistics of task::Broker.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "BrokerTestSupport.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+#include <chrono>
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIMemoryPagePool mpp;
+  AIThreadPool thread_pool;
+  [[maybe_unused]] AIQueueHandle queue_handle = thread_pool.new_queue(8);
+  AIEngine engine("broker engine");
+
+  // Count misses, hits on running and finished entries, queued callbacks and run times.
+  {
+    auto broker = statefultask::create<broker_type>(CWDEBUG_ONLY(false));
+    broker->run(&engine);
+    int called = 0;
+    Square::s_gated = true;
+    broker->run(IntKey{3}, [&](bool){ ++called; });
+    run_until(engine, [&](){ return !Square::s_waiting.empty(); });
+    // The task is running: these requests are coalesced.
+    broker->run(IntKey{3}, [&](bool){ ++called; });
+    broker->run(IntKey{3}, [&](bool){ ++called; });
+    statefultask::BrokerMetrics::Stats stats = broker->metrics();
+    TEST_CHECK(stats.m_lookups == 3 && stats.m_misses == 1 && stats.m_running_hits == 2 && stats.m_finished_hits == 0);
+    TEST_CHECK(stats.m_tasks_finished == 0);
+    // Queue lengths 1, 2 and 3 were sampled.
+    TEST_CHECK(stats.m_queued_callbacks == 3 && stats.m_max_queue_length == 3 && stats.m_average_queue_length == 2.0);
+    TEST_CHECK(stats.m_size == 1);
+    Square::s_gated = false;
+    release_one();
+    run_until(engine, [&](){ return called == 3; });
+    run_idle(engine);
+    stats = broker->metrics();
+    TEST_CHECK(stats.m_queued_callbacks == 0 && stats.m_tasks_finished == 1);
+    // With a single task the average, the tail and the longest run time are all the same.
+    TEST_CHECK(stats.m_max_run_time > std::chrono::steady_clock::duration::zero());
+    TEST_CHECK(stats.m_average_run_time == stats.m_max_run_time && stats.m_p99_run_time == stats.m_max_run_time);
+    // The task finished: this request is a hit on a finished entry.
+    broker->run(IntKey{3}, [&](bool){ ++called; });
+    run_until(engine, [&](){ return called == 4; });
+    stats = broker->metrics();
+    TEST_CHECK(stats.m_lookups == 4 && stats.m_finished_hits == 1 && stats.m_misses == 1);
+    broker->run(IntKey{4}, [&](bool){ ++called; });
+    run_until(engine, [&](){ return called == 5; });
+    run_idle(engine);
+    stats = broker->metrics();
+    TEST_CHECK(stats.m_misses == 2 && stats.m_tasks_finished == 2 && stats.m_size == 2);
+    stop(engine, broker);
+  }
+}
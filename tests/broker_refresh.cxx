@@ -0,0 +1,84 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Behavioral test of the stale-while-revalidate refresh of task::Broker entries.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "BrokerTestSupport.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+#include <chrono>
+#include <thread>
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIMemoryPagePool mpp;
+  AIThreadPool thread_pool;
+  [[maybe_unused]] AIQueueHandle queue_handle = thread_pool.new_queue(8);
+  AIEngine engine("broker engine");
+
+  // A stale result is still served while the Broker recalculates it; afterwards the new result is served.
+  {
+    auto broker = statefultask::create<broker_type>(CWDEBUG_ONLY(false));
+    broker->set_refresh_after(std::chrono::milliseconds(100));
+    broker->run(&engine);
+    Square::s_created = 0;
+    Square::s_offset = 0;
+    bool done = false;
+    auto task = broker->run(IntKey{4}, [&](bool){ done = true; });
+    run_until(engine, [&](){ return done; });
+    TEST_CHECK(task->result() == 16);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    // Let the refresh wait, so that we can make requests while it is running.
+    Square::s_gated = true;
+    Square::s_offset = 1;
+    done = false;
+    auto stale_task = broker->run(IntKey{4}, [&](bool){ done = true; });
+    // The result is available at once; the callback doesn't wait for the refresh.
+    TEST_CHECK(stale_task == task);
+    run_until(engine, [&](){ return done && !Square::s_waiting.empty(); });
+    TEST_CHECK(Square::s_created == 2);
+    // Requests while the refresh is running still get the old result.
+    done = false;
+    stale_task = broker->run(IntKey{4}, [&](bool){ done = true; });
+    run_until(engine, [&](){ return done; });
+    TEST_CHECK(stale_task == task && stale_task->result() == 16);
+    TEST_CHECK(Square::s_created == 2);
+    // Let the refresh finish; the Broker then swaps in the new task.
+    Square::s_gated = false;
+    release_one();
+    run_until(engine, [&](){ return Square::s_running == 0; });
+    run_idle(engine);
+    done = false;
+    auto new_task = broker->run(IntKey{4}, [&](bool){ done = true; });
+    run_until(engine, [&](){ return done; });
+    TEST_CHECK(new_task != task && new_task->result() == 17);
+    TEST_CHECK(broker->metrics().m_misses == 1);
+    Square::s_offset = 0;
+    stop(engine, broker);
+  }
+}
@@ -0,0 +1,68 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Behavioral test of task::Broker::run_many.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "BrokerTestSupport.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+#include <array>
+#include <span>
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIMemoryPagePool mpp;
+  AIThreadPool thread_pool;
+  [[maybe_unused]] AIQueueHandle queue_handle = thread_pool.new_queue(8);
+  AIEngine engine("broker engine");
+
+  // run_many coalesces duplicate keys: one task per distinct key, and one completion call.
+  {
+    auto broker = statefultask::create<broker_type>(CWDEBUG_ONLY(false));
+    broker->run(&engine);
+    Square::s_created = 0;
+    IntKey const k2{2};
+    IntKey const k3{3};
+    std::array<IntKey const*, 5> const keys{{ &k2, &k3, &k2, &k3, &k2 }};
+    int completions = 0;
+    bool all_succeeded = false;
+    auto tasks = broker->run_many(std::span<IntKey const* const>(keys), std::function<void(bool)>([&](bool success){ ++completions; all_succeeded = success; }));
+    run_until(engine, [&](){ return completions > 0; });
+    run_idle(engine);
+    TEST_CHECK(completions == 1 && all_succeeded);
+    TEST_CHECK(Square::s_created == 2);
+    TEST_CHECK(tasks.size() == keys.size());
+    for (size_t i = 0; i < keys.size(); ++i)
+      TEST_CHECK(tasks[i]->result() == keys[i]->m_n * keys[i]->m_n);
+    TEST_CHECK(tasks[0] == tasks[2] && tasks[0] == tasks[4] && tasks[1] == tasks[3]);
+    statefultask::BrokerMetrics::Stats stats = broker->metrics();
+    TEST_CHECK(stats.m_lookups == 5 && stats.m_misses == 2);
+    TEST_CHECK(stats.m_size == 2);
+    stop(engine, broker);
+  }
+}
@@ -0,0 +1,96 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Behavioral test of heterogeneous lookup in a task::Broker with typed keys.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "BrokerTestSupport.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+#include <functional>
+#include <string>
+#include <string_view>
+
+// The type used for lookups: refers to a name without owning it.
+struct NameView
+{
+  std::string_view m_name;
+
+  uint64_t hash() const { return std::hash<std::string_view>{}(m_name); }
+  void print_on(std::ostream& os) const { os << "NameView:" << m_name; }
+};
+
+// The key stored in the map of the Broker: owns a copy of the name.
+struct NameKey
+{
+  std::string m_name;
+
+  NameKey(NameView view) : m_name(view.m_name) { }
+
+  uint64_t hash() const { return std::hash<std::string_view>{}(m_name); }
+  bool operator==(NameKey const& other) const { return m_name == other.m_name; }
+  bool operator==(NameView const& view) const { return m_name == view.m_name; }
+  void initialize(boost::intrusive_ptr<Square> const& task) const { task->set_n(static_cast<int>(m_name.size())); }
+  void print_on(std::ostream& os) const { os << "NameKey:" << m_name; }
+};
+
+using name_broker_type = task::Broker<Square, statefultask::TypedBrokerKey<NameKey>>;
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIMemoryPagePool mpp;
+  AIThreadPool thread_pool;
+  [[maybe_unused]] AIQueueHandle queue_handle = thread_pool.new_queue(8);
+  AIEngine engine("broker engine");
+
+  // Look up NameKey's with NameView's; a miss stores a copy of the name.
+  {
+    auto broker = statefultask::create<name_broker_type>(CWDEBUG_ONLY(false));
+    broker->run(&engine);
+    Square::s_created = 0;
+    int called = 0;
+    std::string buffer = "abc";
+    auto task = broker->run(NameView{buffer}, [&](bool){ ++called; });
+    // Overwrite the buffer that the view referred to: the Broker must have its own copy.
+    buffer[0] = 'x';
+    auto same_task = broker->run(NameView{"abc"}, [&](bool){ ++called; });
+    TEST_CHECK(same_task == task);
+    // A lookup with the stored key type finds the same entry.
+    same_task = broker->run(NameKey{NameView{"abc"}}, [&](bool){ ++called; });
+    TEST_CHECK(same_task == task);
+    auto other_task = broker->run(NameView{"abcd"}, [&](bool){ ++called; });
+    TEST_CHECK(other_task != task);
+    run_until(engine, [&](){ return called == 4; });
+    TEST_CHECK(task->result() == 9 && other_task->result() == 16);
+    TEST_CHECK(Square::s_created == 2);
+    statefultask::BrokerMetrics::Stats stats = broker->metrics();
+    TEST_CHECK(stats.m_lookups == 4 && stats.m_misses == 2);
+    TEST_CHECK(stats.m_size == 2);
+    broker->abort();
+    run_until(engine, [&](){ return broker->finished(); });
+  }
+}
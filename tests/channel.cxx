@@ -0,0 +1,202 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Behavioral test of statefultask::Channel.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "TestSupport.h"
+#include "statefultask/Channel.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+#include <vector>
+
+using channel_type = statefultask::Channel<int, 4>;
+
+// Push the integers [0, count) into the channel.
+class Producer : public AIStatefulTask
+{
+ protected:
+  using direct_base_type = AIStatefulTask;
+
+  enum producer_state_type {
+    Producer_push = direct_base_type::state_end
+  };
+
+ public:
+  static constexpr state_type state_end = Producer_push + 1;
+
+ private:
+  channel_type& m_channel;
+  int const m_count;
+  int m_next;
+  int m_value;
+
+ public:
+  Producer(channel_type& channel, int count) : AIStatefulTask(CWDEBUG_ONLY(false)), m_channel(channel), m_count(count), m_next(0), m_value(0) { }
+
+ protected:
+  ~Producer() override = default;
+
+  char const* state_str_impl(state_type run_state) const override
+  {
+    switch (run_state)
+    {
+      AI_CASE_RETURN(Producer_push);
+    }
+    AI_NEVER_REACHED;
+  }
+
+  char const* task_name_impl() const override { return "Producer"; }
+
+  void multiplex_impl(state_type run_state) override
+  {
+    switch (run_state)
+    {
+      case Producer_push:
+        set_state(Producer_push);       // Try again when signaled.
+        while (m_next < m_count)
+        {
+          m_value = m_next;
+          if (!m_channel.push(m_value, this, 1))
+          {
+            wait(1);                    // The channel is full.
+            return;
+          }
+          ++m_next;
+        }
+        finish();
+        break;
+    }
+  }
+};
+
+// Pop count integers from the channel.
+class Consumer : public AIStatefulTask
+{
+ protected:
+  using direct_base_type = AIStatefulTask;
+
+  enum consumer_state_type {
+    Consumer_pop = direct_base_type::state_end
+  };
+
+ public:
+  static constexpr state_type state_end = Consumer_pop + 1;
+
+ private:
+  channel_type& m_channel;
+  size_t const m_count;
+  int m_value;
+
+ public:
+  std::vector<int> m_received;
+
+  Consumer(channel_type& channel, size_t count) : AIStatefulTask(CWDEBUG_ONLY(false)), m_channel(channel), m_count(count), m_value(0) { }
+
+ protected:
+  ~Consumer() override = default;
+
+  char const* state_str_impl(state_type run_state) const override
+  {
+    switch (run_state)
+    {
+      AI_CASE_RETURN(Consumer_pop);
+    }
+    AI_NEVER_REACHED;
+  }
+
+  char const* task_name_impl() const override { return "Consumer"; }
+
+  void multiplex_impl(state_type run_state) override
+  {
+    switch (run_state)
+    {
+      case Consumer_pop:
+        set_state(Consumer_pop);        // Try again when signaled.
+        while (m_received.size() < m_count)
+        {
+          if (!m_channel.pop(m_value, this, 1))
+          {
+            wait(1);                    // The channel is empty.
+            return;
+          }
+          m_received.push_back(m_value);
+        }
+        finish();
+        break;
+    }
+  }
+
+  // A consumer that is aborted while it is registered must remove itself from the channel.
+  void abort_impl() override
+  {
+    m_channel.cancel(this);
+  }
+};
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIMemoryPagePool mpp;
+  AIThreadPool thread_pool;
+  [[maybe_unused]] AIQueueHandle queue_handle = thread_pool.new_queue(8);
+  AIEngine engine("channel engine");
+
+  // Transfer many more elements than fit in the channel: both sides have to wait for each other.
+  {
+    constexpr int count = 1000;
+    channel_type channel;
+    auto consumer = statefultask::create<Consumer>(channel, count);
+    auto producer = statefultask::create<Producer>(channel, count);
+    consumer->run(&engine);
+    producer->run(&engine);
+    run_until(engine, [&](){ return consumer->finished() && producer->finished(); });
+    TEST_CHECK(!consumer->aborted() && !producer->aborted());
+    TEST_CHECK(consumer->m_received.size() == count);
+    for (int i = 0; i < count; ++i)
+      TEST_CHECK(consumer->m_received[i] == i);
+    int value;
+    TEST_CHECK(!channel.try_pop(value));
+  }
+
+  // A consumer that is aborted while waiting is no longer signaled.
+  {
+    channel_type channel;
+    auto consumer = statefultask::create<Consumer>(channel, 1);
+    consumer->run(&engine);
+    run_idle(engine);
+    TEST_CHECK(!consumer->finished());
+    consumer->abort();
+    run_until(engine, [&](){ return consumer->finished(); });
+    TEST_CHECK(consumer->aborted());
+    // The element is not taken by (or signaled to) the aborted consumer.
+    int value = 42;
+    TEST_CHECK(channel.try_push(value));
+    run_idle(engine);
+    TEST_CHECK(consumer->m_received.empty());
+    TEST_CHECK(channel.try_pop(value) && value == 42);
+  }
+}
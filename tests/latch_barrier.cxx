@@ -0,0 +1,204 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Behavioral test of statefultask::Latch and statefultask::Barrier.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "TestSupport.h"
+#include "statefultask/Barrier.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+#include <array>
+
+// Wait until a latch is released.
+class LatchWaiter : public AIStatefulTask
+{
+ protected:
+  using direct_base_type = AIStatefulTask;
+
+  enum latch_waiter_state_type {
+    LatchWaiter_wait = direct_base_type::state_end,
+    LatchWaiter_done
+  };
+
+ public:
+  static constexpr state_type state_end = LatchWaiter_done + 1;
+
+ private:
+  statefultask::Latch& m_latch;
+  statefultask::TaskWaiter m_waiter;
+
+ public:
+  LatchWaiter(statefultask::Latch& latch) : AIStatefulTask(CWDEBUG_ONLY(false)), m_latch(latch) { }
+
+ protected:
+  ~LatchWaiter() override = default;
+
+  char const* state_str_impl(state_type run_state) const override
+  {
+    switch (run_state)
+    {
+      AI_CASE_RETURN(LatchWaiter_wait);
+      AI_CASE_RETURN(LatchWaiter_done);
+    }
+    AI_NEVER_REACHED;
+  }
+
+  char const* task_name_impl() const override { return "LatchWaiter"; }
+
+  void multiplex_impl(state_type run_state) override
+  {
+    switch (run_state)
+    {
+      case LatchWaiter_wait:
+        set_state(LatchWaiter_done);
+        if (!m_latch.wait(m_waiter, this, 1))
+        {
+          wait(1);
+          break;
+        }
+        [[fallthrough]];
+      case LatchWaiter_done:
+        finish();
+        break;
+    }
+  }
+};
+
+constexpr uint32_t participants = 3;
+constexpr int phases = 5;
+
+// Run a number of phases, synchronized by a barrier.
+class BarrierTask : public AIStatefulTask
+{
+ protected:
+  using direct_base_type = AIStatefulTask;
+
+  enum barrier_task_state_type {
+    BarrierTask_work = direct_base_type::state_end,
+    BarrierTask_next_phase
+  };
+
+ public:
+  static constexpr state_type state_end = BarrierTask_next_phase + 1;
+
+ private:
+  statefultask::Barrier& m_barrier;
+  std::array<std::atomic<uint32_t>, phases>& m_arrivals;        // The number of tasks that arrived at the end of each phase.
+  statefultask::TaskWaiter m_waiter;
+  int m_phase;
+
+ public:
+  BarrierTask(statefultask::Barrier& barrier, std::array<std::atomic<uint32_t>, phases>& arrivals) :
+    AIStatefulTask(CWDEBUG_ONLY(false)), m_barrier(barrier), m_arrivals(arrivals), m_phase(0) { }
+
+ protected:
+  ~BarrierTask() override = default;
+
+  char const* state_str_impl(state_type run_state) const override
+  {
+    switch (run_state)
+    {
+      AI_CASE_RETURN(BarrierTask_work);
+      AI_CASE_RETURN(BarrierTask_next_phase);
+    }
+    AI_NEVER_REACHED;
+  }
+
+  char const* task_name_impl() const override { return "BarrierTask"; }
+
+  void multiplex_impl(state_type run_state) override
+  {
+    switch (run_state)
+    {
+      case BarrierTask_work:
+        // Nobody may start the next phase before everyone finished the previous one.
+        TEST_CHECK(m_phase == 0 || m_arrivals[m_phase - 1] == participants);
+        m_arrivals[m_phase]++;
+        set_state(BarrierTask_next_phase);
+        if (!m_barrier.arrive_and_wait(m_waiter, this, 1))
+        {
+          wait(1);
+          break;
+        }
+        [[fallthrough]];
+      case BarrierTask_next_phase:
+        // Everyone arrived.
+        TEST_CHECK(m_arrivals[m_phase] == participants);
+        if (++m_phase == phases)
+          finish();
+        else
+          set_state(BarrierTask_work);
+        break;
+    }
+  }
+};
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIMemoryPagePool mpp;
+  AIThreadPool thread_pool;
+  [[maybe_unused]] AIQueueHandle queue_handle = thread_pool.new_queue(8);
+  AIEngine engine("latch_barrier engine");
+
+  // The waiter is released by the third count down, not before.
+  {
+    statefultask::Latch latch(participants);
+    auto waiter = statefultask::create<LatchWaiter>(latch);
+    waiter->run(&engine);
+    for (uint32_t i = 0; i < participants; ++i)
+    {
+      run_idle(engine);
+      TEST_CHECK(!waiter->finished());
+      TEST_CHECK(!latch.try_wait());
+      latch.count_down();
+    }
+    TEST_CHECK(latch.try_wait());
+    run_until(engine, [&](){ return waiter->finished(); });
+    TEST_CHECK(!waiter->aborted());
+
+    // Waiting on a released latch doesn't wait at all.
+    auto late_waiter = statefultask::create<LatchWaiter>(latch);
+    late_waiter->run(&engine);
+    run_until(engine, [&](){ return late_waiter->finished(); });
+  }
+
+  // Three tasks run several phases in lock step.
+  {
+    statefultask::Barrier barrier(participants);
+    std::array<std::atomic<uint32_t>, phases> arrivals{};
+    std::array<boost::intrusive_ptr<BarrierTask>, participants> tasks;
+    for (auto& task : tasks)
+    {
+      task = statefultask::create<BarrierTask>(barrier, arrivals);
+      task->run(&engine);
+    }
+    run_until(engine, [&](){ for (auto& task : tasks) if (!task->finished()) return false; return true; });
+    for (auto& arrived : arrivals)
+      TEST_CHECK(arrived == participants);
+  }
+}
@@ -0,0 +1,58 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Report and check the layout of AIStatefulTask.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "TestSupport.h"
+#include "statefultask/AIStatefulTask.h"
+#include <cstdint>
+#include <iostream>
+
+// The layout is also checked at compile time; this writes the report to the test log,
+// so that a change in size or in the offsets of the hot members is visible, and checks
+// where the hot members of an actual task end up.
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIStatefulTask::print_layout_on(std::cout);
+
+  constexpr std::size_t cache_line_size = 64;
+  AIStatefulTask::layout_st const layout = AIStatefulTask::layout();
+  TEST_CHECK(layout.hot_begin < cache_line_size);
+  TEST_CHECK(layout.hot_begin < layout.hot_end);
+  TEST_CHECK(layout.hot_end - layout.hot_begin <= layout.max_hot_size);
+  TEST_CHECK(layout.hot_end <= layout.size);
+
+  // A task is allocated with operator new, so it is not necessarily aligned to a cache line:
+  // the hot members then touch at most one cache line more than they would at best.
+  auto task = statefultask::create<LockTask>([](AIStatefulTask*, AIStatefulTask::condition_type){ return true; }, [](){});
+  std::uintptr_t const begin = reinterpret_cast<std::uintptr_t>(task.get()) + layout.hot_begin;
+  std::uintptr_t const end = reinterpret_cast<std::uintptr_t>(task.get()) + layout.hot_end;
+  std::size_t const touched_cache_lines = (end - 1) / cache_line_size - begin / cache_line_size + 1;
+  std::cout << "The hot members of a task at " << task.get() << " touch " << touched_cache_lines << " cache lines.\n";
+  TEST_CHECK(touched_cache_lines <= layout.max_hot_size / cache_line_size + 1);
+}
@@ -0,0 +1,121 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Behavioral test of statefultask::LockAll.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "TestSupport.h"
+#include "statefultask/LockAll.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIMemoryPagePool mpp;
+  AIThreadPool thread_pool;
+  [[maybe_unused]] AIQueueHandle queue_handle = thread_pool.new_queue(8);
+  AIEngine engine("lock_all engine");
+
+  AIStatefulTaskMutex a;
+  AIStatefulTaskMutex b;
+  statefultask::LockAll group(a, b);
+
+  auto single = [&](AIStatefulTaskMutex& m){
+    return statefultask::create<LockTask>(
+        [&m](AIStatefulTask* task, AIStatefulTask::condition_type condition){ return m.lock(task, condition) != nullptr; },
+        [&m](){ m.unlock(); });
+  };
+  auto both = [&](){
+    return statefultask::create<LockTask>(
+        [&group](AIStatefulTask* task, AIStatefulTask::condition_type condition){ return group.lock(task, condition); },
+        [&group](){ group.unlock(); });
+  };
+
+  // Returns true if m is currently locked (by anyone).
+  auto prober = statefultask::create<LockTask>([](AIStatefulTask*, AIStatefulTask::condition_type){ return true; }, [](){});
+  auto is_locked = [&](AIStatefulTaskMutex& m){
+    if (!m.try_lock(prober.get()))
+      return true;
+    m.unlock();
+    return false;
+  };
+
+  // Without contention the group gets both mutexes at once.
+  {
+    auto g = both();
+    g->run(&engine);
+    run_idle(engine);
+    TEST_CHECK(g->locked());
+    TEST_CHECK(is_locked(a) && is_locked(b));
+    g->release();
+    run_idle(engine);
+    TEST_CHECK(!is_locked(a) && !is_locked(b));
+  }
+
+  // The group waits while one of the mutexes is held, and is signaled only once it holds both.
+  {
+    auto ta = single(a);
+    ta->run(&engine);
+    run_idle(engine);
+    TEST_CHECK(ta->locked());
+    auto g = both();
+    g->run(&engine);
+    run_idle(engine);
+    TEST_CHECK(!g->locked());
+    ta->release();
+    run_until(engine, [&](){ return g->locked(); });
+    TEST_CHECK(is_locked(a) && is_locked(b));
+    g->release();
+    run_idle(engine);
+    TEST_CHECK(!is_locked(a) && !is_locked(b));
+  }
+
+  // Both mutexes are held by different tasks; the group is granted only after both were released.
+  {
+    auto ta = single(a);
+    auto tb = single(b);
+    ta->run(&engine);
+    tb->run(&engine);
+    run_idle(engine);
+    TEST_CHECK(ta->locked() && tb->locked());
+    auto g = both();
+    g->run(&engine);
+    run_idle(engine);
+    TEST_CHECK(!g->locked());
+    // First release the mutex that the group locks last (LockAll locks them in the order of their address).
+    AIStatefulTaskMutex* first = std::less<AIStatefulTaskMutex*>{}(&a, &b) ? &b : &a;
+    (first == &a ? ta : tb)->release();
+    run_idle(engine);
+    TEST_CHECK(!g->locked());
+    (first == &a ? tb : ta)->release();
+    run_until(engine, [&](){ return g->locked(); });
+    TEST_CHECK(is_locked(a) && is_locked(b));
+    g->release();
+    run_idle(engine);
+    TEST_CHECK(!is_locked(a) && !is_locked(b));
+  }
+}
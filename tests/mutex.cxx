@@ -0,0 +1,229 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Behavioral test of AIStatefulTaskMutex.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "TestSupport.h"
+#include "statefultask/AIStatefulTaskMutex.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+#include <vector>
+
+// A task that increments a counter, protected by a mutex, a number of times; yielding in between.
+class CountingTask : public AIStatefulTask
+{
+ protected:
+  using direct_base_type = AIStatefulTask;
+
+  enum counting_task_state_type {
+    CountingTask_lock = direct_base_type::state_end,
+    CountingTask_locked
+  };
+
+ public:
+  static constexpr state_type state_end = CountingTask_locked + 1;
+
+ private:
+  AIStatefulTaskMutex& m_mutex;
+  int& m_counter;
+  std::atomic<int>& m_inside;
+  int m_iterations;
+
+ public:
+  CountingTask(AIStatefulTaskMutex& mutex, int& counter, std::atomic<int>& inside, int iterations) :
+    AIStatefulTask(CWDEBUG_ONLY(false)), m_mutex(mutex), m_counter(counter), m_inside(inside), m_iterations(iterations) { }
+
+ protected:
+  ~CountingTask() override = default;
+
+  char const* state_str_impl(state_type run_state) const override
+  {
+    switch (run_state)
+    {
+      AI_CASE_RETURN(CountingTask_lock);
+      AI_CASE_RETURN(CountingTask_locked);
+    }
+    AI_NEVER_REACHED;
+  }
+
+  char const* task_name_impl() const override { return "CountingTask"; }
+
+  void multiplex_impl(state_type run_state) override
+  {
+    switch (run_state)
+    {
+      case CountingTask_lock:
+        set_state(CountingTask_locked);
+        if (!m_mutex.lock(this, 1))
+        {
+          wait(1);
+          break;
+        }
+        [[fallthrough]];
+      case CountingTask_locked:
+      {
+        {
+          statefultask::AdoptLock lock(m_mutex);
+          TEST_CHECK(++m_inside == 1);
+          ++m_counter;
+          --m_inside;
+        }
+        if (--m_iterations == 0)
+        {
+          finish();
+          break;
+        }
+        set_state(CountingTask_lock);
+        yield();
+        break;
+      }
+    }
+  }
+};
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIMemoryPagePool mpp;
+  AIThreadPool thread_pool;
+  AIQueueHandle const queue_handle = thread_pool.new_queue(8);
+  AIEngine engine("mutex engine");
+
+  AIStatefulTaskMutex m;
+  std::vector<int> order;
+  auto locker = [&](int id){
+    return statefultask::create<LockTask>(
+        [&](AIStatefulTask* task, AIStatefulTask::condition_type condition){ return m.lock(task, condition) != nullptr; },
+        [&, id](){ order.push_back(id); m.unlock(); });
+  };
+
+  // try_lock obtains a free mutex, and fails without queuing the task when it is locked.
+  {
+    auto t = locker(0);
+    TEST_CHECK(m.try_lock(t.get()));
+    TEST_CHECK(!m.try_lock(t.get()));
+    m.unlock();
+    TEST_CHECK(m.try_lock(t.get()));
+    m.unlock();
+  }
+
+  // Contended: the waiting tasks obtain the mutex in the order in which they called lock.
+  {
+    auto t1 = locker(1);
+    t1->run(&engine);
+    run_idle(engine);
+    TEST_CHECK(t1->locked());
+    auto t2 = locker(2);
+    auto t3 = locker(3);
+    auto t4 = locker(4);
+    t3->run(&engine);
+    run_idle(engine);
+    t2->run(&engine);
+    run_idle(engine);
+    t4->run(&engine);
+    run_idle(engine);
+    TEST_CHECK(!t2->locked() && !t3->locked() && !t4->locked());
+    TEST_CHECK(!m.try_lock(t1.get()));
+
+    // Each release passes the mutex to the task that queued itself first.
+    t1->release();
+    run_until(engine, [&](){ return t3->locked(); });
+    TEST_CHECK(!t2->locked() && !t4->locked());
+    t3->release();
+    run_until(engine, [&](){ return t2->locked(); });
+    TEST_CHECK(!t4->locked());
+    t2->release();
+    run_until(engine, [&](){ return t4->locked(); });
+    t4->release();
+    run_until(engine, [&](){ return order.size() == 4; });
+    TEST_CHECK((order == std::vector<int>{1, 3, 2, 4}));
+  }
+
+  // Tasks that lock and unlock the mutex concurrently from the thread pool: unlock races with
+  // tasks that are appending themselves to the queue, and none of them waits for the other.
+  {
+    constexpr int number_of_tasks = 8;
+    constexpr int iterations = 1000;
+    int counter = 0;
+    std::atomic<int> inside = 0;
+    std::atomic<int> finished = 0;
+    std::vector<boost::intrusive_ptr<CountingTask>> tasks;
+    for (int i = 0; i < number_of_tasks; ++i)
+      tasks.push_back(statefultask::create<CountingTask>(m, counter, inside, iterations));
+    for (auto& task : tasks)
+      task->run(queue_handle, [&](bool success){ TEST_CHECK(success); ++finished; });
+    run_until(engine, [&](){ return finished == number_of_tasks; }, std::chrono::seconds(60));
+    TEST_CHECK(counter == number_of_tasks * iterations);
+  }
+
+  // In hand-off mode, the next owner is run by the thread that unlocks the mutex, right after the unlocking task,
+  // if it runs in the same engine; otherwise it is woken up normally.
+  {
+    AIStatefulTaskMutex hm(true);
+    auto handoff_locker = [&](){
+      return statefultask::create<LockTask>(
+          [&](AIStatefulTask* task, AIStatefulTask::condition_type condition){ return hm.lock(task, condition) != nullptr; },
+          [&](){ hm.unlock(); });
+    };
+    auto t1 = handoff_locker();
+    auto t2 = handoff_locker();
+    t1->run(&engine);
+    run_idle(engine);
+    t2->run(&engine);
+    run_idle(engine);
+    TEST_CHECK(t1->locked() && !t2->locked());
+
+    // A task that is added to the engine after t1 records whether t2 already has the mutex when it runs.
+    bool t2_locked_before_x = false;
+    auto x = statefultask::create<LockTask>(
+        [](AIStatefulTask*, AIStatefulTask::condition_type){ return true; },
+        [&](){ t2_locked_before_x = t2->locked(); });
+    x->run(&engine);
+    run_idle(engine);
+    t1->release();
+    x->release();
+    run_until(engine, [&](){ return t2->locked() && !x->locked(); });
+    TEST_CHECK(t2_locked_before_x);
+
+    AIEngine engine2("mutex engine 2");
+    auto t3 = handoff_locker();
+    t3->run(&engine2);
+    run_idle(engine2);
+    TEST_CHECK(!t3->locked());
+    t2->release();
+    run_idle(engine);
+    TEST_CHECK(!t3->locked());
+    run_until(engine2, [&](){ return t3->locked(); });
+    t3->release();
+    run_idle(engine2);
+  }
+
+  // The mutex is free again.
+  auto t = locker(0);
+  TEST_CHECK(m.try_lock(t.get()));
+  m.unlock();
+}
@@ -0,0 +1,129 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Behavioral test of the priority inheritance of AIStatefulTaskMutex.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "TestSupport.h"
+#include "statefultask/AIStatefulTaskMutex.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+#include <thread>
+
+// A LockTask that counts how often it runs and that can be given a target before it locks.
+class PriorityLockTask : public LockTask
+{
+ private:
+  Handler m_target;
+  std::atomic<int> m_runs;
+
+ public:
+  PriorityLockTask(Handler target, lock_type lock, unlock_type unlock) : LockTask(std::move(lock), std::move(unlock)), m_target(target), m_runs(0) { }
+
+  int runs() const { return m_runs; }
+
+ protected:
+  ~PriorityLockTask() override = default;
+
+  void multiplex_impl(state_type run_state) override
+  {
+    ++m_runs;
+    // The priority of a task that locks a mutex is that of the thread pool queue that it runs in.
+    if (run_state == LockTask_lock && m_target != Handler::idle)
+      target(m_target);
+    LockTask::multiplex_impl(run_state);
+  }
+};
+
+int queue_length(AIThreadPool& thread_pool, AIQueueHandle queue_handle)
+{
+  auto queues_access = thread_pool.queues_read_access();
+  return thread_pool.get_queue(queues_access, queue_handle).producer_access().length();
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIMemoryPagePool mpp;
+  // A single thread, so that it can be kept busy while the owner of the mutex is waiting in a queue.
+  AIThreadPool thread_pool(1);
+  AIQueueHandle const high_priority = thread_pool.new_queue(8);
+  AIQueueHandle const low_priority = thread_pool.new_queue(8);
+  AIEngine engine("mutex_priority engine");
+
+  AIStatefulTaskMutex m;
+  auto locker = [&](AIStatefulTask::Handler target){
+    return statefultask::create<PriorityLockTask>(target,
+        [&](AIStatefulTask* task, AIStatefulTask::condition_type condition){ return m.lock(task, condition) != nullptr; },
+        [&](){ m.unlock(); });
+  };
+
+  // The owner locks the mutex from the low priority queue.
+  auto owner = locker(AIStatefulTask::Handler::idle);
+  bool owner_finished = false;
+  owner->run(low_priority, [&](bool){ owner_finished = true; });
+  run_until(engine, [&](){ return owner->locked(); });
+
+  // Keep the only thread of the pool busy.
+  std::atomic<bool> blocked = false;
+  std::atomic<bool> unblock = false;
+  {
+    auto queues_access = thread_pool.queues_read_access();
+    auto& queue = thread_pool.get_queue(queues_access, high_priority);
+    queue.producer_access().move_in([&](){
+      blocked = true;
+      while (!unblock)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      return false;
+    });
+    queue.notify_one();
+  }
+  run_until(engine, [&](){ return blocked.load(); });
+
+  // Let the owner unlock the mutex: it has to wait in the low priority queue.
+  owner->release();
+  TEST_CHECK(queue_length(thread_pool, low_priority) == 1);
+  TEST_CHECK(queue_length(thread_pool, high_priority) == 0);
+
+  // A task from the high priority queue that starts to wait for the mutex moves the owner to the high priority queue.
+  auto waiter = locker(high_priority);
+  bool waiter_finished = false;
+  waiter->run([&](bool){ waiter_finished = true; });
+  TEST_CHECK(!waiter->locked());
+  TEST_CHECK(queue_length(thread_pool, high_priority) == 1);
+
+  // The owner runs once (from its new entry; the one in the low priority queue is stale) and passes the mutex to the waiter.
+  unblock = true;
+  run_until(engine, [&](){ return owner_finished && waiter->locked(); });
+  run_until(engine, [&](){ return queue_length(thread_pool, low_priority) == 0 && queue_length(thread_pool, high_priority) == 0; });
+  TEST_CHECK(owner->runs() == 2);
+
+  waiter->release();
+  run_until(engine, [&](){ return waiter_finished; });
+  // The mutex is free again.
+  TEST_CHECK(m.try_lock(waiter.get()));
+  m.unlock();
+}
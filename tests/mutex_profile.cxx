@@ -0,0 +1,90 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Behavioral test of the contention profiling of AIStatefulTaskMutex.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "TestSupport.h"
+#include "statefultask/AIStatefulTaskMutex.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+#include <sstream>
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIMemoryPagePool mpp;
+  AIThreadPool thread_pool;
+  [[maybe_unused]] AIQueueHandle queue_handle = thread_pool.new_queue(8);
+  AIEngine engine("mutex_profile engine");
+
+  AIStatefulTaskMutex m;
+  TEST_CHECK(!m.profile());
+  m.enable_profiling("test mutex");
+  auto locker = [&](){
+    return statefultask::create<LockTask>(
+        [&](AIStatefulTask* task, AIStatefulTask::condition_type condition){ return m.lock(task, condition) != nullptr; },
+        [&](){ m.unlock(); });
+  };
+
+  // The first task gets the mutex without waiting, the next two are queued behind it.
+  auto t1 = locker();
+  t1->run(&engine);
+  run_idle(engine);
+  TEST_CHECK(t1->locked());
+  auto t2 = locker();
+  auto t3 = locker();
+  t2->run(&engine);
+  t3->run(&engine);
+  run_idle(engine);
+  TEST_CHECK(!t2->locked() && !t3->locked());
+
+  // Pass the mutex on from task to task.
+  t1->release();
+  run_until(engine, [&](){ return t2->locked(); });
+  t2->release();
+  run_until(engine, [&](){ return t3->locked(); });
+  t3->release();
+  run_idle(engine);
+
+  auto snapshot = m.profile()->snapshot();
+  TEST_CHECK(snapshot.size() == 1);
+  statefultask::MutexProfile::Stats const& stats = snapshot["LockTask"];
+  TEST_CHECK(stats.m_acquisitions == 3);
+  TEST_CHECK(stats.m_contended_acquisitions == 2);
+  // The second task saw one waiting task (itself), the third two.
+  TEST_CHECK(stats.m_queue_depth_sum == 3);
+  TEST_CHECK(stats.m_max_queue_depth == 2);
+  TEST_CHECK(stats.m_max_wait_time <= stats.m_wait_time);
+  TEST_CHECK(stats.m_max_hold_time <= stats.m_hold_time);
+  TEST_CHECK(stats.m_hold_time.count() > 0);
+
+  // The statistics can be printed for all profiled mutexes.
+  std::ostringstream os;
+  statefultask::MutexProfile::print_all(os);
+  TEST_CHECK(os.str().find("Mutex \"test mutex\":") != std::string::npos);
+  TEST_CHECK(os.str().find("acquisitions:3, contended:2") != std::string::npos);
+}
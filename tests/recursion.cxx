@@ -0,0 +1,116 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Test that nested immediate runs are deferred beyond the maximum recursion depth.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "TestSupport.h"
+#include "statefultask/AIStatefulTask.h"
+#include <algorithm>
+
+constexpr int chain_length = 1000;
+constexpr int max_multiplex_depth = 32;         // AIStatefulTask::max_multiplex_depth.
+
+int s_nesting = 0;                              // The number of calls to multiplex_impl on the stack.
+int s_max_nesting = 0;
+int s_finished = 0;
+
+// A task that runs a child task with the immediate handler, which runs a child task, and so on.
+class ChainTask : public AIStatefulTask
+{
+ protected:
+  using direct_base_type = AIStatefulTask;
+
+  enum chain_task_state_type {
+    ChainTask_start = direct_base_type::state_end,
+    ChainTask_done
+  };
+
+ public:
+  static constexpr state_type state_end = ChainTask_done + 1;
+
+ private:
+  int const m_remaining;                        // The number of tasks that still have to be created after this one.
+  boost::intrusive_ptr<ChainTask> m_child;
+
+ public:
+  ChainTask(int remaining) : AIStatefulTask(CWDEBUG_ONLY(false)), m_remaining(remaining) { }
+
+ protected:
+  ~ChainTask() override = default;
+
+  char const* state_str_impl(state_type run_state) const override
+  {
+    switch (run_state)
+    {
+      AI_CASE_RETURN(ChainTask_start);
+      AI_CASE_RETURN(ChainTask_done);
+    }
+    AI_NEVER_REACHED;
+  }
+
+  char const* task_name_impl() const override { return "ChainTask"; }
+
+  void multiplex_impl(state_type run_state) override
+  {
+    s_max_nesting = std::max(s_max_nesting, ++s_nesting);
+    switch (run_state)
+    {
+      case ChainTask_start:
+        set_state(ChainTask_done);
+        if (m_remaining > 0)
+        {
+          m_child = statefultask::create<ChainTask>(m_remaining - 1);
+          m_child->run(this, 1);
+          wait(1);
+          break;
+        }
+        [[fallthrough]];
+      case ChainTask_done:
+        ++s_finished;
+        finish();
+        break;
+    }
+    --s_nesting;
+  }
+};
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  bool done = false;
+  bool succeeded = false;
+  auto root = statefultask::create<ChainTask>(chain_length - 1);
+  root->run([&](bool success){ done = true; succeeded = success; });
+
+  // All runs that were deferred are executed before the outermost run() returns.
+  TEST_CHECK(done && succeeded);
+  TEST_CHECK(s_finished == chain_length);
+  TEST_CHECK(s_nesting == 0);
+  // The chain is far longer than the maximum recursion depth, yet the stack never got deeper than that.
+  TEST_CHECK(s_max_nesting <= max_multiplex_depth);
+  TEST_CHECK(s_max_nesting > 1);
+}
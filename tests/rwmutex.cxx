@@ -0,0 +1,86 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Behavioral test of AIStatefulTaskRWMutex.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "TestSupport.h"
+#include "statefultask/AIStatefulTaskRWMutex.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIMemoryPagePool mpp;
+  AIThreadPool thread_pool;
+  [[maybe_unused]] AIQueueHandle queue_handle = thread_pool.new_queue(8);
+  AIEngine engine("rwmutex engine");
+
+  AIStatefulTaskRWMutex m;
+  auto reader = [&](){ return statefultask::create<LockTask>([&](AIStatefulTask* task, AIStatefulTask::condition_type condition){ return m.rdlock(task, condition); }, [&](){ m.rdunlock(); }); };
+  auto writer = [&](){ return statefultask::create<LockTask>([&](AIStatefulTask* task, AIStatefulTask::condition_type condition){ return m.wrlock(task, condition); }, [&](){ m.wrunlock(); }); };
+
+  // Two readers share the lock.
+  auto r1 = reader();
+  auto r2 = reader();
+  r1->run(&engine);
+  r2->run(&engine);
+  run_idle(engine);
+  TEST_CHECK(r1->locked() && r2->locked());
+
+  // A writer has to wait for the readers, and a reader that arrives after it has to wait for the writer (FIFO).
+  auto w = writer();
+  w->run(&engine);
+  run_idle(engine);
+  auto r3 = reader();
+  r3->run(&engine);
+  run_idle(engine);
+  TEST_CHECK(!w->locked() && !r3->locked());
+  TEST_CHECK(!m.try_rdlock(r3.get()) && !m.try_wrlock(w.get()));
+
+  // The writer only gets the lock after the last reader released it.
+  r1->release();
+  run_idle(engine);
+  TEST_CHECK(!w->locked());
+  r2->release();
+  run_until(engine, [&](){ return w->locked(); });
+  TEST_CHECK(!r3->locked());
+
+  // Releasing the write lock grants the waiting reader.
+  w->release();
+  run_until(engine, [&](){ return r3->locked(); });
+  TEST_CHECK(m.try_rdlock(r1.get()));
+  TEST_CHECK(!m.try_wrlock(w.get()));
+  m.rdunlock();
+  r3->release();
+  run_idle(engine);
+
+  // The mutex is free again.
+  TEST_CHECK(m.try_wrlock(w.get()));
+  TEST_CHECK(!m.try_rdlock(r1.get()));
+  m.wrunlock();
+}
@@ -0,0 +1,81 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Behavioral test of AIStatefulTaskSemaphore.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "TestSupport.h"
+#include "statefultask/AIStatefulTaskSemaphore.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIMemoryPagePool mpp;
+  AIThreadPool thread_pool;
+  [[maybe_unused]] AIQueueHandle queue_handle = thread_pool.new_queue(8);
+  AIEngine engine("semaphore engine");
+
+  AIStatefulTaskSemaphore s(3);
+  auto acquirer = [&](AIStatefulTaskSemaphore::count_type permits){
+    return statefultask::create<LockTask>(
+        [&s, permits](AIStatefulTask* task, AIStatefulTask::condition_type condition){ return s.acquire(task, permits, condition); },
+        [&s, permits](){ s.release(permits); });
+  };
+
+  // The first task gets two of the three permits.
+  auto t1 = acquirer(2);
+  t1->run(&engine);
+  run_idle(engine);
+  TEST_CHECK(t1->locked());
+  TEST_CHECK(s.available() == 1);
+
+  // A task that wants two permits has to wait.
+  auto t2 = acquirer(2);
+  t2->run(&engine);
+  run_idle(engine);
+  TEST_CHECK(!t2->locked());
+
+  // A task that wants only one permit doesn't overtake the waiting task, although a permit is available.
+  auto t3 = acquirer(1);
+  t3->run(&engine);
+  run_idle(engine);
+  TEST_CHECK(!t3->locked());
+  TEST_CHECK(!s.try_acquire(1));
+
+  // Releasing the two permits of the first task grants both waiting tasks, in order.
+  t1->release();
+  run_until(engine, [&](){ return t2->locked() && t3->locked(); });
+  TEST_CHECK(s.available() == 0);
+
+  t2->release();
+  t3->release();
+  run_idle(engine);
+  TEST_CHECK(s.available() == 3);
+  TEST_CHECK(s.try_acquire(3));
+  s.release(3);
+}
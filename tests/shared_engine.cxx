@@ -0,0 +1,172 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Behavioral test of AISharedEngine run by several threads.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "TestSupport.h"
+#include "statefultask/AISharedEngine.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+#include <array>
+#include <thread>
+#include <vector>
+
+constexpr int rounds = 1000;
+
+// One of two tasks that pass a token back and forth.
+//
+// A task signals its partner right before it goes idle itself, so the partner usually
+// is signaled by one thread while it is still being run by another thread; that
+// exercises the running_readded path of AISharedEngine.
+class PingPong : public AIStatefulTask
+{
+ protected:
+  using direct_base_type = AIStatefulTask;
+
+  enum ping_pong_state_type {
+    PingPong_start = direct_base_type::state_end,
+    PingPong_pass
+  };
+
+ public:
+  static constexpr state_type state_end = PingPong_pass + 1;
+
+ private:
+  bool const m_starts;                  // Set for the task that has the token initially.
+  PingPong* m_partner;
+  int m_rounds;
+  std::atomic<bool> m_in_multiplex;     // Used to detect that the task is run by two threads at the same time.
+
+ public:
+  PingPong(bool starts) : AIStatefulTask(CWDEBUG_ONLY(false)), m_starts(starts), m_partner(nullptr), m_rounds(0), m_in_multiplex(false) { }
+
+  void set_partner(PingPong* partner) { m_partner = partner; }
+  int rounds_done() const { return m_rounds; }
+
+ protected:
+  ~PingPong() override = default;
+
+  char const* state_str_impl(state_type run_state) const override
+  {
+    switch (run_state)
+    {
+      AI_CASE_RETURN(PingPong_start);
+      AI_CASE_RETURN(PingPong_pass);
+    }
+    AI_NEVER_REACHED;
+  }
+
+  char const* task_name_impl() const override { return "PingPong"; }
+
+  void multiplex_impl(state_type run_state) override
+  {
+    // A task is never run by two threads concurrently.
+    TEST_CHECK(!m_in_multiplex.exchange(true));
+    switch (run_state)
+    {
+      case PingPong_start:
+        set_state(PingPong_pass);
+        if (!m_starts)
+        {
+          wait(1);
+          break;
+        }
+        [[fallthrough]];
+      case PingPong_pass:
+        ++m_rounds;
+        // The partner that didn't start finishes at the same round, it doesn't need the token anymore.
+        if (m_starts || m_rounds < rounds)
+          m_partner->signal(1);
+        if (m_rounds == rounds)
+          finish();
+        else
+          wait(1);
+        break;
+    }
+    m_in_multiplex = false;
+  }
+};
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIMemoryPagePool mpp;
+  AIThreadPool thread_pool;
+  [[maybe_unused]] AIQueueHandle queue_handle = thread_pool.new_queue(8);
+  AISharedEngine engine("shared engine");
+
+  constexpr int number_of_threads = 4;
+  constexpr int number_of_rings = 8;
+
+  std::atomic<bool> done(false);
+  std::atomic<int> threads_left(number_of_threads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < number_of_threads; ++t)
+    threads.emplace_back([&](){
+      while (!done)
+        engine.mainloop();
+      --threads_left;
+    });
+
+  std::array<boost::intrusive_ptr<PingPong>, 2 * number_of_rings> tasks;
+  for (int r = 0; r < number_of_rings; ++r)
+  {
+    tasks[2 * r] = statefultask::create<PingPong>(true);
+    tasks[2 * r + 1] = statefultask::create<PingPong>(false);
+    tasks[2 * r]->set_partner(tasks[2 * r + 1].get());
+    tasks[2 * r + 1]->set_partner(tasks[2 * r].get());
+  }
+  // Start the waiting tasks first, so that they are idle before the first signal arrives (that isn't required though).
+  for (int i = 1; i < 2 * number_of_rings; i += 2)
+    tasks[i]->run(&engine);
+  for (int i = 0; i < 2 * number_of_rings; i += 2)
+    tasks[i]->run(&engine);
+
+  auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+  for (auto& task : tasks)
+    while (!task->finished())
+    {
+      TEST_CHECK(std::chrono::steady_clock::now() < deadline);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+  // Stop the threads. Keep waking them up because a thread might only go to sleep after a call to wake_up.
+  done = true;
+  while (threads_left > 0)
+  {
+    engine.wake_up();
+    std::this_thread::yield();
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  for (auto& task : tasks)
+  {
+    TEST_CHECK(!task->aborted());
+    TEST_CHECK(task->rounds_done() == rounds);
+  }
+}
@@ -0,0 +1,85 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Behavioral test of thread confined tasks.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "TestSupport.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+
+// A LockTask, that doesn't lock anything, which reports when it is destructed.
+class ConfinedTask : public LockTask
+{
+ private:
+  bool& m_destructed;
+
+ public:
+  ConfinedTask(bool& destructed) : LockTask([](AIStatefulTask*, condition_type){ return true; }, [](){ }), m_destructed(destructed) { }
+
+ protected:
+  ~ConfinedTask() override { m_destructed = true; }
+};
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIMemoryPagePool mpp;
+  AIThreadPool thread_pool;
+  [[maybe_unused]] AIQueueHandle queue_handle = thread_pool.new_queue(8);
+  AIEngine engine("thread_confined engine");
+
+  bool destructed = false;
+  boost::intrusive_ptr<ConfinedTask> task = statefultask::create<ConfinedTask>(destructed);
+  TEST_CHECK(!task->is_thread_confined());
+  task->set_thread_confined();
+  TEST_CHECK(task->is_thread_confined());
+  TEST_CHECK(task->unique());
+
+  // Copies are counted in the plain reference count; unique() sees them.
+  {
+    boost::intrusive_ptr<ConfinedTask> copy = task;
+    TEST_CHECK(!task->unique());
+    boost::intrusive_ptr<AIStatefulTask> base_copy = copy;
+    TEST_CHECK(!task->unique());
+  }
+  TEST_CHECK(task->unique());
+
+  // Run the task in an engine whose main loop is called by this thread.
+  bool finished = false;
+  task->run(&engine, [&](bool success){ TEST_CHECK(success); finished = true; });
+  run_idle(engine);
+  TEST_CHECK(task->locked());
+  task->release();
+  run_until(engine, [&](){ return finished; });
+  run_idle(engine);
+
+  // All references that the engine took are released again: ours is the last one.
+  TEST_CHECK(task->unique());
+  TEST_CHECK(!destructed);
+  task.reset();
+  TEST_CHECK(destructed);
+}
@@ -0,0 +1,139 @@
+/**
+ * ai-statefultask -- Asynchronous, Stateful Task Scheduler library.
+ *
+ * @file
+ * @brief Behavioral test of AIStatefulTask::wait_for.
+ *
+ * @Copyright (C) 2022  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of ai-statefultask.
+ *
+ * Ai-statefultask is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ai-statefultask is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ai-statefultask.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "TestSupport.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+#include "threadpool/Timer.h"
+#include <chrono>
+#include <thread>
+
+// A task that waits with wait_for for condition 1, and then (without timeout) for condition 2.
+class TimeoutTask : public AIStatefulTask
+{
+ protected:
+  using direct_base_type = AIStatefulTask;
+
+  enum timeout_task_state_type {
+    TimeoutTask_start = direct_base_type::state_end,
+    TimeoutTask_woken,
+    TimeoutTask_done
+  };
+
+ public:
+  static constexpr state_type state_end = TimeoutTask_done + 1;
+
+ private:
+  std::atomic<bool> m_woken;
+  std::atomic<bool> m_timed_out;
+
+ public:
+  TimeoutTask() : AIStatefulTask(CWDEBUG_ONLY(false)), m_woken(false), m_timed_out(false) { }
+
+  bool woken() const { return m_woken; }
+  bool woken_by_timer() const { return m_timed_out; }
+
+ protected:
+  ~TimeoutTask() override = default;
+
+  char const* state_str_impl(state_type run_state) const override
+  {
+    switch (run_state)
+    {
+      AI_CASE_RETURN(TimeoutTask_start);
+      AI_CASE_RETURN(TimeoutTask_woken);
+      AI_CASE_RETURN(TimeoutTask_done);
+    }
+    AI_NEVER_REACHED;
+  }
+
+  char const* task_name_impl() const override { return "TimeoutTask"; }
+
+  void multiplex_impl(state_type run_state) override
+  {
+    switch (run_state)
+    {
+      case TimeoutTask_start:
+        set_state(TimeoutTask_woken);
+        wait_for(1, threadpool::Interval<50, std::chrono::milliseconds>());
+        break;
+      case TimeoutTask_woken:
+        m_timed_out = timed_out();
+        m_woken = true;
+        set_state(TimeoutTask_done);
+        wait(2);
+        break;
+      case TimeoutTask_done:
+        finish();
+        break;
+    }
+  }
+};
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIMemoryPagePool mpp;
+  AIThreadPool thread_pool;
+  [[maybe_unused]] AIQueueHandle queue_handle = thread_pool.new_queue(8);
+  AIEngine engine("wait_for engine");
+
+  // Without a signal, the task is woken up by the timer.
+  {
+    auto task = statefultask::create<TimeoutTask>();
+    bool finished = false;
+    task->run(&engine, [&](bool){ finished = true; });
+    run_until(engine, [&](){ return task->woken(); });
+    TEST_CHECK(task->woken_by_timer());
+    task->signal(2);
+    run_until(engine, [&](){ return finished; });
+  }
+
+  // A signal before the timeout wakes up the task, and the timer then no longer wakes it up: not even the next wait.
+  {
+    auto task = statefultask::create<TimeoutTask>();
+    bool finished = false;
+    task->run(&engine, [&](bool){ finished = true; });
+    run_idle(engine);
+    TEST_CHECK(!task->woken());
+    task->signal(1);
+    run_until(engine, [&](){ return task->woken(); });
+    TEST_CHECK(!task->woken_by_timer());
+    // Wait well past the timeout; the task must still be waiting for condition 2.
+    auto const until = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+    while (std::chrono::steady_clock::now() < until)
+    {
+      run_idle(engine);
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    TEST_CHECK(!finished);
+    task->signal(2);
+    run_until(engine, [&](){ return finished; });
+  }
+}